@@ -0,0 +1,65 @@
+// Rasterizes a TrueType font & writes the atlas as a C++ header.
+//
+// Usage: atlas_gen <font.ttf> <name> [pt] > <name>.h
+//
+// The font is rasterized at `pt` points (15 by default, like
+// `AnsiArt::font_size_pt`).
+//
+// The header defines `<name>` (the serialized atlas) and `<name>_len`. Load it
+// with `maf::FontAtlas::LoadAtlas(<name>, <name>_len, error)`. Programs that
+// only use generated atlases can be built with `-DMAF_ANSI_ART_NO_FREETYPE`
+// and without linking FreeType.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "maf/ansi_art.hh"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <font.ttf> <name> [pt] > <name>.h\n", argv[0]);
+    return 1;
+  }
+  int font_size_pt = 15;
+  if (argc == 4) {
+    char *end;
+    font_size_pt = strtol(argv[3], &end, 10);
+    if (*argv[3] == 0 || *end != 0) {
+      fprintf(stderr, "Invalid font size: %s\n", argv[3]);
+      return 1;
+    }
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "Couldn't open %s\n", argv[1]);
+    return 1;
+  }
+  std::string ttf;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    ttf.append(buf, n);
+  }
+  fclose(f);
+
+  std::string error;
+  auto atlas = maf::FontAtlas::LoadTTF((const uint8_t *)ttf.data(), ttf.size(),
+                                       error, "", font_size_pt);
+  if (atlas == nullptr) {
+    fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+    return 1;
+  }
+  auto bytes = atlas->Bytes();
+  std::string name = argv[2];
+  printf("// Generated by atlas_gen from %s at %d pt. Do not edit.\n", argv[1],
+         font_size_pt);
+  printf("#pragma once\n\n");
+  printf("alignas(64) constexpr unsigned char %s[] = {", name.c_str());
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    printf(i % 12 ? " 0x%02x," : "\n  0x%02x,", bytes[i]);
+  }
+  printf("\n};\n");
+  printf("constexpr unsigned int %s_len = %zu;\n", name.c_str(), bytes.size());
+  return 0;
+}
@@ -0,0 +1,4 @@
+#!/bin/bash
+# Usage: ./atlas_gen.sh <font.ttf> <name> [pt] > <name>.h
+
+g++ -pthread -std=c++2a -I. atlas_gen.cc maf/*.cc `pkg-config --cflags --libs freetype2` -o atlas_gen && ./atlas_gen "$@"
@@ -0,0 +1,85 @@
+// Measures how long it takes for a cancelled render to return.
+//
+// Starts asynchronous renders of the example image, cancels each of them
+// after a varying delay & reports the time from CancelRender until the
+// render finishes, for each glyph search.
+//
+// Usage: ./bench_cancel.sh [width] [threads] [runs]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "maf/ansi_art.hh"
+
+#include "example-image.h"
+#include "example-font.h"
+
+using Clock = std::chrono::steady_clock;
+
+int main(int argc, char *argv[]) {
+  int width = argc > 1 ? atoi(argv[1]) : 200;
+  int threads = argc > 2 ? atoi(argv[2]) : 4;
+  int runs = std::max(argc > 3 ? atoi(argv[3]) : 30, 1);
+
+  std::string error;
+  auto atlas = maf::FontAtlas::LoadTTF(UbuntuMono_R_ttf, UbuntuMono_R_ttf_len,
+                                       error);
+  if (atlas == nullptr) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  const maf::GlyphSearch searches[] = {
+      maf::GlyphSearch::kExhaustive, maf::GlyphSearch::kBounded,
+      maf::GlyphSearch::kApproximate, maf::GlyphSearch::kBinary};
+  const char *search_names[] = {"exhaustive", "bounded", "approximate",
+                                "binary"};
+  printf("%d columns, %d threads, %d runs\n", width, threads, runs);
+  printf("%-12s %12s %12s %12s\n", "search", "full (ms)", "median (ms)",
+         "max (ms)");
+  for (int s = 0; s < 4; ++s) {
+    auto art = std::unique_ptr<maf::AnsiArt>(maf::AnsiArt::New());
+    art->SetFontAtlas(atlas);
+    art->LoadImage(example_image.width, example_image.height,
+                   example_image.pixel_data);
+    art->width = width;
+    art->glyph_search = searches[s];
+
+    // Uncancelled render, to spread the cancellation points over it.
+    auto start = Clock::now();
+    art->StartRender(threads);
+    while (art->GetRenderProgress() < 1) {
+      std::this_thread::yield();
+    }
+    double full_ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count();
+
+    std::vector<double> latencies;
+    for (int run = 0; run < runs; ++run) {
+      art->StartRender(threads);
+      auto delay = std::chrono::duration<double, std::milli>(
+          full_ms * (run + 0.5) / runs * 0.9);
+      std::this_thread::sleep_for(delay);
+      auto cancel = Clock::now();
+      art->CancelRender();
+      while (art->GetRenderProgress() < 1) {
+        std::this_thread::yield();
+      }
+      latencies.push_back(
+          std::chrono::duration<double, std::milli>(Clock::now() - cancel)
+              .count());
+    }
+    art.reset();
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-12s %12.2f %12.2f %12.2f\n", search_names[s], full_ms,
+           latencies[latencies.size() / 2], latencies.back());
+  }
+  return 0;
+}
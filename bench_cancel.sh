@@ -0,0 +1,3 @@
+#!/bin/bash
+
+g++ -O2 -pthread -std=c++2a -I. bench_cancel.cc maf/*.cc `pkg-config --cflags --libs freetype2` -o bench_cancel && ./bench_cancel "$@"
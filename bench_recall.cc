@@ -0,0 +1,124 @@
+// Compares GlyphSearch::kApproximate with the exhaustive search.
+//
+// Renders a few images with both searches and reports the render times & the
+// share of cells that the approximate search renders exactly like the
+// exhaustive one (same glyph & colors), for several `search_candidates`.
+//
+// Usage: ./bench_recall.sh [width]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "maf/ansi_art.hh"
+#include "maf/ansi_art_atlas.hh"
+
+#include "example-image.h"
+#include "example-font.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Renders twice (the first render prepares the glyphs) & returns the time of
+// the second one.
+static double TimeRender(maf::AnsiArt &art) {
+  art.Render();
+  auto start = Clock::now();
+  art.Render();
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// Share of the `glyph_width` × `glyph_height` cells that are identical in
+// both RGBA results.
+static double IdenticalCells(const std::string &a, const std::string &b,
+                             int width, int height, int glyph_width,
+                             int glyph_height) {
+  int cols = width / glyph_width, rows = height / glyph_height;
+  int identical = 0;
+  for (int cy = 0; cy < rows; ++cy) {
+    for (int cx = 0; cx < cols; ++cx) {
+      bool same = true;
+      for (int y = 0; y < glyph_height && same; ++y) {
+        size_t offset =
+            ((size_t)(cy * glyph_height + y) * width + cx * glyph_width) * 4;
+        same = memcmp(&a[offset], &b[offset], glyph_width * 4) == 0;
+      }
+      identical += same;
+    }
+  }
+  return 100. * identical / (cols * rows);
+}
+
+int main(int argc, char *argv[]) {
+  int width = argc > 1 ? atoi(argv[1]) : 160;
+
+  std::string error;
+  auto atlas = maf::FontAtlas::LoadTTF(UbuntuMono_R_ttf, UbuntuMono_R_ttf_len,
+                                       error);
+  if (atlas == nullptr) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  auto &font = static_cast<const maf::FontAtlasImpl &>(*atlas);
+
+  int w = example_image.width, h = example_image.height;
+  std::vector<uint8_t> noise(w * h * 4), gradient(w * h * 4);
+  srand(1);
+  for (uint8_t &value : noise) {
+    value = rand();
+  }
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      uint8_t *p = &gradient[(y * w + x) * 4];
+      p[0] = x * 255 / w;
+      p[1] = y * 255 / h;
+      p[2] = 128;
+      p[3] = 255;
+    }
+  }
+  const uint8_t *images[] = {example_image.pixel_data, noise.data(),
+                             gradient.data()};
+  const char *image_names[] = {"photo", "noise", "gradient"};
+  const int candidates[] = {8, 32, 64};
+
+  printf("%d columns, %zu glyphs\n", width, font.glyphs.size());
+  printf("%-9s %-8s %12s", "image", "samples", "exhaustive");
+  for (int k : candidates) {
+    printf("   %12s %9s", ("K=" + std::to_string(k)).c_str(), "identical");
+  }
+  printf("\n");
+  auto art = std::unique_ptr<maf::AnsiArt>(maf::AnsiArt::New());
+  art->SetFontAtlas(atlas);
+  art->width = width;
+  for (int i = 0; i < 3; ++i) {
+    art->LoadImage(w, h, images[i]);
+    for (int sample_width : {0, 4}) {
+      art->sample_width = sample_width;
+      art->sample_height = sample_width * 2;
+      art->glyph_search = maf::GlyphSearch::kExhaustive;
+      double exhaustive_ms = TimeRender(*art);
+      std::string expected = art->result_rgba_bytes;
+      char samples[16] = "glyph";
+      if (sample_width > 0) {
+        snprintf(samples, sizeof(samples), "%dx%d", sample_width,
+                 sample_width * 2);
+      }
+      printf("%-9s %-8s %9.1f ms", image_names[i], samples, exhaustive_ms);
+      art->glyph_search = maf::GlyphSearch::kApproximate;
+      for (int k : candidates) {
+        art->search_candidates = k;
+        double ms = TimeRender(*art);
+        double identical = IdenticalCells(
+            art->result_rgba_bytes, expected, art->result_rgba_width,
+            art->result_rgba_height, font.glyph_width, font.glyph_height);
+        printf("   %9.1f ms %8.1f%%", ms, identical);
+      }
+      printf("\n");
+    }
+  }
+  return 0;
+}
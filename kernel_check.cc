@@ -0,0 +1,55 @@
+// Checks that all of the glyph matching kernels supported by this CPU pick the
+// same glyphs. Renders the example image with each of them (and each glyph
+// search) and compares the results with the ones of the scalar kernel.
+//
+// Usage: ./kernel_check.sh
+
+#include <cstdio>
+#include <string>
+
+#include "maf/ansi_art.hh"
+#include "maf/ansi_art_kernels.hh"
+
+#include "example-image.h"
+#include "example-font.h"
+
+static std::string Render(maf::GlyphSearch search) {
+  auto art = maf::AnsiArt::New();
+  art->LoadImage(example_image.width, example_image.height,
+                 example_image.pixel_data);
+  art->LoadTTF(UbuntuMono_R_ttf, UbuntuMono_R_ttf_len);
+  art->width = 80;
+  art->glyph_search = search;
+  art->Render();
+  std::string result = art->result_raw;
+  delete art;
+  return result;
+}
+
+int main() {
+  const maf::MatchingKernel *kernels[8];
+  int n_kernels = maf::SupportedMatchingKernels(kernels, 8);
+  const maf::GlyphSearch searches[] = {
+      maf::GlyphSearch::kExhaustive, maf::GlyphSearch::kBounded,
+      maf::GlyphSearch::kApproximate, maf::GlyphSearch::kBinary};
+  const char *search_names[] = {"exhaustive", "bounded", "approximate",
+                                "binary"};
+  int failures = 0;
+  for (int s = 0; s < 4; ++s) {
+    maf::ForceMatchingKernel(kernels[0]);
+    std::string expected = Render(searches[s]);
+    for (int k = 1; k < n_kernels; ++k) {
+      maf::ForceMatchingKernel(kernels[k]);
+      bool same = Render(searches[s]) == expected;
+      printf("%-12s %-8s %s\n", search_names[s], kernels[k]->name,
+             same ? "OK" : "DIFFERENT");
+      failures += !same;
+    }
+  }
+  maf::ForceMatchingKernel(nullptr);
+  if (n_kernels == 1) {
+    printf("Only the %s kernel is supported - nothing to compare.\n",
+           kernels[0]->name);
+  }
+  return failures > 0;
+}
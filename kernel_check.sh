@@ -0,0 +1,3 @@
+#!/bin/bash
+
+g++ -O2 -pthread -std=c++2a -I. kernel_check.cc maf/*.cc `pkg-config --cflags --libs freetype2` -o kernel_check && ./kernel_check
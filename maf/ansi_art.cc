@@ -1,15 +1,24 @@
 #include "maf/ansi_art.hh"
 
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
 #include <cmath>
-#include <ft2build.h>
+#include <cstring>
+#include <memory>
+#include <numeric>
 #include <string>
+#include <strings.h>
 #include <vector>
-#include FT_FREETYPE_H
 #include <pthread.h>
 
 #include "maf/ansi.hh"
-#include "maf/unicode.hh"
+#include "maf/ansi_art_atlas.hh"
+#include "maf/ansi_art_index.hh"
+#include "maf/ansi_art_kernels.hh"
 #include "maf/str.hh"
+#include "maf/thread_pool.hh"
+#include "maf/unicode.hh"
 
 namespace maf {
 
@@ -65,7 +74,12 @@ struct vec4 {
     return vec4(r * other.r, g * other.g, b * other.b, a * other.a);
   }
   float sum() const { return r + g + b + a; }
+  float dot(const vec4 &other) const { return (*this * other).sum(); }
   vec4 abs() const { return vec4(fabs(r), fabs(g), fabs(b), fabs(a)); }
+  vec4 clamp() const {
+    return vec4(std::clamp(r, 0.f, 1.f), std::clamp(g, 0.f, 1.f),
+                std::clamp(b, 0.f, 1.f), std::clamp(a, 0.f, 1.f));
+  }
   Pixel pixel() const {
     return Pixel{(uint8_t)(r * 255), (uint8_t)(g * 255), (uint8_t)(b * 255),
                  (uint8_t)(a * 255)};
@@ -74,141 +88,233 @@ struct vec4 {
 
 class AnsiArtImpl : public AnsiArt {
 
-  struct Glyph {
-    int unicode;
-    std::string utf8;
-    uint8_t *pixels;
-  };
+  // Shared with other instances. Released when the last user goes away.
+  std::shared_ptr<const FontAtlasImpl> font;
 
-  struct Font {
-    int glyph_height;
-    int glyph_width;
-    float aspect;
-    std::vector<Glyph> glyphs;
-  };
+  std::string LoadTTF(const uint8_t *data, size_t size) override {
+    // The new font replaces the old one only after it loads successfully.
+    std::string error;
+    auto atlas = FontAtlas::LoadTTF(data, size, error, font_cache_dir,
+                                    font_size_pt, allowed_characters);
+    if (atlas) {
+      SetFontAtlas(atlas);
+    }
+    return error;
+  }
 
-  Font font;
+  void SetFontAtlas(std::shared_ptr<const FontAtlas> atlas) override {
+    font = std::static_pointer_cast<const FontAtlasImpl>(atlas);
+    glyphs_utf8 = font ? font->GlyphsUTF8() : "";
+  }
 
-  std::string LoadTTF(const uint8_t *data, size_t size) override {
-    glyphs_utf8 = "";
-    FT_Library library;
-    FT_Error ft_error = FT_Init_FreeType(&library);
-    if (ft_error) {
-      return "Couldn't initialize freetype: " + std::to_string(ft_error);
-    }
-    FT_Face face;
-    ft_error =
-        FT_New_Memory_Face(library, (FT_Byte *)data, (FT_Long)size, 0, &face);
-    if (ft_error) {
-      return "Couldn't load font";
-    }
-    int font_size_pt = 15;
-    ft_error = FT_Set_Char_Size(face, /* handle to face object           */
-                                0,    /* char_width in 1/64th of points  */
-                                font_size_pt *
-                                    64, /* char_height in 1/64th of points */
-                                72,     /* horizontal device resolution    */
-                                72);    /* vertical device resolution      */
-
-    font.glyph_width = face->size->metrics.max_advance / 64;
-    font.glyph_height = face->size->metrics.height / 64;
-    font.aspect = float(font.glyph_height) / font.glyph_width;
-    font.glyphs.clear();
-
-    // The unicode '█' starts at the top of the character cell.
-    // We use its `bitmap_top` offset to find the baseline position.
-    uint32_t block_index = FT_Get_Char_Index(face, 0x2588);
-    FT_Load_Glyph(face, block_index, FT_LOAD_RENDER);
-    int baseline = face->glyph->bitmap_top;
-
-    FT_ULong charcode;
-    FT_UInt gindex;
-    charcode = FT_Get_First_Char(face, &gindex);
-    int n_chars = 0;
-    while (gindex != 0) {
-
-      if (charcode == 9 || charcode == 13) {
-        charcode = FT_Get_Next_Char(face, charcode, &gindex);
-        continue;
-      }
-      char buf[80];
-      FT_Get_Glyph_Name(face, gindex, buf, sizeof(buf));
-      std::string name = buf;
+  size_t GetAtlasMemoryUsage() override {
+    return font ? font->MemoryUsage() : 0;
+  }
 
-      std::string utf8 = UnicodeToUTF8(charcode);
+  struct Image {
+    int width = 0, height = 0;
+    // Rows of pixels, `stride` bytes apart. Either borrowed from the caller
+    // (LoadImageView) or pointing into `copy` (LoadImage).
+    const uint8_t *pixels = nullptr;
+    size_t stride = 0;
+    PixelFormat format = PixelFormat::kRGBA;
+    std::vector<uint8_t> copy;
 
-      if (name.find(".") == std::string::npos &&
-          forbidden_characters.find(utf8) == std::string::npos) {
+    // Premultiplied image (see `PremultipliedPixel`) stored as four planes
+    // (r, g, b, a). Rows are padded to a cache line, for vector loads.
+    struct Level {
+      int width = 0, height = 0;
+      size_t stride = 0; // values between rows
+      AlignedArray<uint16_t> values;
 
-        ft_error = FT_Load_Glyph(face, gindex, FT_LOAD_RENDER);
-        if (ft_error) {
-          return "FT_Load_Glyph " + std::to_string(ft_error);
-        }
-        FT_GlyphSlot glyph = face->glyph;
+      void Resize(int new_width, int new_height) {
+        width = new_width;
+        height = new_height;
+        stride = (width + 31) / 32 * 32; // 64 bytes
+        values.Resize(4 * stride * height);
+      }
+      uint16_t *Plane(int c) { return values.data + c * stride * height; }
+      const uint16_t *Plane(int c) const {
+        return values.data + c * stride * height;
+      }
+    };
+    // Mip pyramid. Texels of `levels[i]` are averages of 2^i × 2^i blocks of
+    // pixels (cropped at the image edges). Levels above 0 are built by
+    // `LoadImageView`. Level 0 is converted from `pixels` by `PrepareLevel0`,
+    // only once a render samples the image at full resolution.
+    std::vector<Level> levels;
 
-        if (glyph->advance.x / 64 == font.glyph_width) {
-          auto bitmap = glyph->bitmap;
-          if (bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
-            return "FT_Bitmap is not FT_PIXEL_MODE_GRAY";
-          }
-          font.glyphs.emplace_back();
-          auto &new_glyph = font.glyphs.back();
-          new_glyph.unicode = charcode;
-          new_glyph.utf8 = utf8;
-          n_chars += 1;
-
-          int n = font.glyph_width * font.glyph_height;
-          new_glyph.pixels = new uint8_t[n];
-          for (int i = 0; i < n; ++i)
-            new_glyph.pixels[i] = 0;
-
-          for (int y = 0; y < bitmap.rows; ++y) {
-            for (int x = 0; x < bitmap.width; ++x) {
-              int tile_x = glyph->bitmap_left + x;
-              if (tile_x >= font.glyph_width)
-                continue;
-              if (tile_x < 0)
-                continue;
-              int tile_y = baseline - glyph->bitmap_top + y;
-              if (tile_y >= font.glyph_height)
-                continue;
-              if (tile_y < 0)
-                continue;
-              int i = tile_y * font.glyph_width + tile_x;
-              new_glyph.pixels[i] = bitmap.buffer[y * bitmap.pitch + x];
+    // Builds level `level + 1` from `level`. `row(y, slot)` returns the r
+    // plane of row `y` of `level`, followed by the g, b & a planes
+    // `plane_step` values apart (`slot` is 0 or 1 - the two rows used at a
+    // time). Children are weighted by the number of pixels that they cover,
+    // which is smaller in the last column & row when the image edges crop
+    // them. This keeps every texel the exact average of its cropped block.
+    template <typename Row>
+    Level Downsample(int level, size_t plane_step, Row row) const {
+      int src_width = levels[level].width, src_height = levels[level].height;
+      int size = 1 << level; // pixels spanned by the texels of `level`
+      // Pixels covered by column / row `i` of `level` along an axis of
+      // `n` texels & `image_size` pixels. Zero past the last one.
+      auto covered = [&](int i, int n, int image_size) -> int64_t {
+        return i < n ? std::min(size, image_size - i * size) : 0;
+      };
+      Level next;
+      next.Resize((src_width + 1) / 2, (src_height + 1) / 2);
+      for (int y = 0; y < next.height; ++y) {
+        const uint16_t *row0 = row(2 * y, 0);
+        const uint16_t *row1 = row(std::min(2 * y + 1, src_height - 1), 1);
+        int64_t wy0 = covered(2 * y, src_height, height);
+        int64_t wy1 = covered(2 * y + 1, src_height, height);
+        for (int c = 0; c < 4; ++c) {
+          const uint16_t *r0 = row0 + c * plane_step;
+          const uint16_t *r1 = row1 + c * plane_step;
+          uint16_t *out = next.Plane(c) + y * next.stride;
+          int x = 0;
+          if (wy0 == wy1) {
+            // All but the last column have four equally weighted children.
+            for (; x < next.width - 1; ++x) {
+              int x0 = 2 * x, x1 = 2 * x + 1;
+              out[x] = (r0[x0] + r0[x1] + r1[x0] + r1[x1] + 2) / 4;
             }
           }
-          glyphs_utf8 += utf8;
+          for (; x < next.width; ++x) {
+            int x0 = 2 * x, x1 = std::min(2 * x + 1, src_width - 1);
+            int64_t wx0 = covered(2 * x, src_width, width);
+            int64_t wx1 = covered(2 * x + 1, src_width, width);
+            int64_t total = (wx0 + wx1) * (wy0 + wy1);
+            int64_t sum = wx0 * wy0 * r0[x0] + wx1 * wy0 * r0[x1] +
+                          wx0 * wy1 * r1[x0] + wx1 * wy1 * r1[x1];
+            out[x] = (sum + total / 2) / total;
+          }
         }
       }
-      charcode = FT_Get_Next_Char(face, charcode, &gindex);
+      return next;
     }
 
-    return "";
-  };
+    void BuildPyramid() {
+      levels.clear();
+      levels.emplace_back();
+      levels[0].width = width;
+      levels[0].height = height;
+      if (width > 1 || height > 1) {
+        // Source rows are converted into planes one at a time.
+        std::vector<uint16_t> rows[2];
+        rows[0].resize(4 * width);
+        rows[1].resize(4 * width);
+        levels.push_back(Downsample(0, width, [&](int y, int slot) {
+          uint16_t *planes = rows[slot].data();
+          PremultiplyRowPlanar(format, pixels + y * stride, width, planes,
+                               planes + width, planes + 2 * width,
+                               planes + 3 * width);
+          return (const uint16_t *)planes;
+        }));
+      }
+      while (levels.back().width > 1 || levels.back().height > 1) {
+        // Higher levels read the planes of the previous one in place.
+        const Level &prev = levels.back();
+        Level next = Downsample(
+            levels.size() - 1, prev.stride * prev.height,
+            [&](int y, int slot) { return prev.Plane(0) + y * prev.stride; });
+        levels.push_back(std::move(next));
+      }
+    }
 
-  struct Image {
-    int width, height;
-    std::vector<Pixel> pixels;
-    vec4 Read(float x, float y) {
-      if (y >= height || y < 0 || x >= width || x < 0) {
-        return vec4(0, 0, 0, 0);
-      }
-      int nearest_x = (int)roundf(x);
-      int nearest_y = (int)roundf(y);
-      int i = nearest_y * width + nearest_x;
-      Pixel &p = pixels[i];
-      return vec4(p.r / 255.f, p.g / 255.f, p.b / 255.f, p.a / 255.f);
+    void PrepareLevel0() {
+      Level &level = levels[0];
+      if (level.values.data != nullptr || width == 0) {
+        return;
+      }
+      level.Resize(width, height);
+      for (int y = 0; y < height; ++y) {
+        size_t i = y * level.stride;
+        PremultiplyRowPlanar(format, pixels + y * stride, width,
+                             level.Plane(0) + i, level.Plane(1) + i,
+                             level.Plane(2) + i, level.Plane(3) + i);
+      }
     }
   };
 
   Image image;
 
-  void LoadImage(int width, int height, const uint8_t *rgba_bytes) override {
+  void LoadImage(int width, int height, const uint8_t *bytes,
+                 PixelFormat format) override {
+    size_t stride = (size_t)width * BytesPerPixel(format);
+    std::vector<uint8_t> copy(bytes, bytes + stride * height);
+    LoadImageView(width, height, copy.data(), stride, format);
+    image.copy = std::move(copy); // moving keeps the buffer in place
+  }
+
+  void LoadImageView(int width, int height, const uint8_t *bytes,
+                     size_t stride, PixelFormat format) override {
     image.width = width;
     image.height = height;
-    image.pixels.resize(width * height);
-    memcpy(&image.pixels[0], rgba_bytes, 4 * width * height);
+    image.pixels = bytes;
+    image.stride = stride;
+    image.format = format;
+    image.copy.clear();
+    image.BuildPyramid();
+  }
+
+  // Coverage moments of a glyph at the matching resolution: Σw & Σw².
+  struct GlyphMoments {
+    float sum;
+    float sq_sum;
+  };
+
+  struct CellMoments {
+    float n = 0;     // number of samples
+    vec4 sum;        // Σc (premultiplied)
+    float sq_sum = 0; // Σ|c|²
+  };
+
+  // Finds the fg & bg colors that minimize the squared error between the
+  // premultiplied cell samples `c` and `fg·w + bg·(1-w)`, where `w` is the
+  // glyph coverage. This is a 2×2 linear least-squares problem whose normal
+  // equations depend only on the glyph moments (Σw, Σw², n) and on Σw·c
+  // (`weighted_sum`) & Σc. The returned error is computed in closed form as
+  // well, so the image samples are never revisited.
+  static float SolveColors(const GlyphMoments &glyph, const CellMoments &cell,
+                           const vec4 &weighted_sum, vec4 &fg, vec4 &bg) {
+    float n = cell.n;
+    float w = glyph.sum;
+    float w2 = glyph.sq_sum;
+    // Normal equations: [a b; b d] · [fg; bg] = [p; q]
+    float a = w2;
+    float b = w - w2;
+    float d = n - 2 * w + w2;
+    const vec4 &p = weighted_sum;
+    vec4 q = cell.sum - weighted_sum;
+    float det = a * d - b * b;
+    if (det > 1e-6f * n * n) {
+      fg = (p * d - q * b) * (1 / det);
+      bg = (q * a - p * b) * (1 / det);
+    } else {
+      // Uniform glyph (e.g. space or full block) - both colors are the mean.
+      fg = bg = cell.sum * (1 / n);
+    }
+
+    // Foreground is always opaque.
+    if (fg.a > 1e-6f) {
+      fg /= fg.a;
+    } else {
+      fg = {};
+    }
+    fg = fg.clamp();
+    fg.a = 1;
+    // Background is either opaque or fully transparent.
+    if (bg.a < 0.2) {
+      bg = {};
+    } else {
+      bg /= bg.a;
+      bg = bg.clamp();
+      bg.a = 1;
+    }
+
+    // Σ|c - bg - (fg - bg)·w|² expanded into moments.
+    vec4 delta = fg - bg;
+    return cell.sq_sum - 2 * bg.dot(cell.sum) - 2 * delta.dot(weighted_sum) +
+           n * bg.dot(bg) + 2 * w * bg.dot(delta) + w2 * delta.dot(delta);
   }
 
   struct Task {
@@ -221,206 +327,1120 @@ class AnsiArtImpl : public AnsiArt {
     int char_y;
     vec4 fg;
     vec4 bg;
-    Glyph *glyph;
+    const Glyph *glyph;
   };
 
-  pthread_t renderer = 0;
+  // Set while a render started by StartRender is in progress. Cleared
+  // together with `progress` reaching 1, under `render_mut`, so that a caller
+  // that saw the render finish can always start the next one.
+  bool rendering = false;
+  pthread_mutex_t render_mut = PTHREAD_MUTEX_INITIALIZER;
+  // Set by CancelRender. Workers poll it between units of work: the
+  // exhaustive search between glyph blocks (at most kCellBatch × kGlyphBlock
+  // glyph evaluations), the bounded search every kGlyphBlock glyphs of a cell
+  // and the other searches between cells (`search_candidates` glyph
+  // evaluations for kApproximate, one popcount pass over the glyphs for
+  // kBinary).
+  std::atomic<bool> cancelled = false;
   int worker_count = 8;
-  std::vector<pthread_t> workers;
+  // Cells in the order in which they're rendered, tile by tile. Tile `i`
+  // spans `tasks[batches[i]]` ... `tasks[batches[i + 1] - 1]`. Workers claim
+  // whole tiles by bumping `next_batch`.
   std::vector<Task> tasks;
+  std::vector<int> batches;
+  std::atomic<int> next_batch = 0;
+  std::atomic<int> tasks_done = 0;
+  // One slot per cell, indexed by `char_y * width + char_x`. Each slot is
+  // written only by the worker that claimed the cell.
   std::vector<TaskResult> task_results;
-  float progress = 0;
-  pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+  std::atomic<float> progress = 0;
 
-  static void *RenderWorkerThread(void *arg) {
-    auto self = (AnsiArtImpl *)arg;
-    self->RenderWorker();
-    pthread_exit(nullptr);
+  // Every sample is the average of the image over a box of
+  // `img_char_width / match_width` × `img_char_height / match_height`
+  // pixels. Boxes are filtered at the pyramid level where they span 2-4
+  // texels, so sampling costs the same regardless of the image size.
+  int sample_level = 0;
+  // Texels `begin` ... `begin + count - 1` of `sample_level` that overlap the
+  // box of a sample along one axis. Their weights (overlap / box size) start
+  // at `sample_weights[weights]`. Parts of the box outside of the image have
+  // no texels, so they count as transparent.
+  struct Footprint {
+    int begin;
+    int count;
+    int weights;
+  };
+  // Footprints of every sample column (`sample_x`) and row (`sample_y`) of
+  // the output. Computed once per render by `PrepareSampling`.
+  std::vector<Footprint> sample_x;
+  std::vector<Footprint> sample_y;
+  std::vector<float> sample_weights;
+
+  const MatchingKernel &kernel = BestMatchingKernel();
+
+  void PrepareSampling(int height, float img_char_width,
+                       float img_char_height) {
+    float box_width = img_char_width / match_width;
+    float box_height = img_char_height / match_height;
+    sample_level = 0;
+    while (sample_level + 1 < (int)image.levels.size() &&
+           std::min(box_width, box_height) >= 4 << sample_level) {
+      ++sample_level;
+    }
+    if (sample_level == 0) {
+      image.PrepareLevel0();
+    }
+    float texel_size = 1 << sample_level;
+    sample_weights.clear();
+    auto footprints = [&](std::vector<Footprint> &out, int n, float box_size,
+                          int image_size, int level_size) {
+      out.resize(n);
+      for (int i = 0; i < n; ++i) {
+        float begin = i * box_size, end = (i + 1) * box_size;
+        Footprint &footprint = out[i];
+        footprint.begin = std::max(0, (int)floorf(begin / texel_size));
+        int texel_end = std::min(level_size, (int)ceilf(end / texel_size));
+        footprint.count = std::max(0, texel_end - footprint.begin);
+        footprint.weights = sample_weights.size();
+        for (int t = footprint.begin; t < texel_end; ++t) {
+          float overlap =
+              std::min({end, (t + 1) * texel_size, (float)image_size}) -
+              std::max(begin, t * texel_size);
+          sample_weights.push_back(std::max(0.f, overlap) / box_size);
+        }
+      }
+    };
+    const Image::Level &level = image.levels[sample_level];
+    footprints(sample_x, width * match_width, box_width, image.width,
+               level.width);
+    footprints(sample_y, height * match_height, box_height, image.height,
+               level.height);
   }
 
-  void RenderWorker() {
-    float height = float(image.height) * width / image.width / font.aspect;
-    float img_char_width = float(image.width) / width;
-    float img_char_height = float(image.height) / height;
-    Pixel *result_rgba = (Pixel *)&result_rgba_bytes[0];
+  // Fills `planes` with the premultiplied image under the given cell and
+  // computes its moments. The image is stored as four planes (r, g, b, a),
+  // each with `match_width` × `match_height` samples in row-major order,
+  // zero-padded to `match_stride`. Samples outside of the image are left
+  // transparent, so the glyph loops can read the buffer without any bounds
+  // checks.
+  void SampleCell(int char_x, int char_y, float *planes,
+                  CellMoments &moments) {
+    std::fill(planes, planes + 4 * match_stride, 0.f);
+    moments = CellMoments();
+    moments.n = match_width * match_height;
+
+    const Footprint *xs = &sample_x[char_x * match_width];
+    const Footprint *ys = &sample_y[char_y * match_height];
+    float *r = planes;
+    float *g = planes + match_stride;
+    float *b = planes + 2 * match_stride;
+    float *a = planes + 3 * match_stride;
+    const Image::Level &level = image.levels[sample_level];
+    const uint16_t *level_r = level.Plane(0), *level_g = level.Plane(1),
+                   *level_b = level.Plane(2), *level_a = level.Plane(3);
+    for (int y = 0; y < match_height; ++y) {
+      const Footprint &fy = ys[y];
+      for (int x = 0; x < match_width; ++x) {
+        const Footprint &fx = xs[x];
+        if (fx.count == 0 || fy.count == 0) {
+          continue;
+        }
+        vec4 col;
+        const float *wx = &sample_weights[fx.weights];
+        for (int ty = 0; ty < fy.count; ++ty) {
+          float wy = sample_weights[fy.weights + ty] / 65025.f;
+          size_t i = (fy.begin + ty) * level.stride + fx.begin;
+          for (int tx = 0; tx < fx.count; ++tx, ++i) {
+            float w = wx[tx] * wy;
+            col.r += level_r[i] * w;
+            col.g += level_g[i] * w;
+            col.b += level_b[i] * w;
+            col.a += level_a[i] * w;
+          }
+        }
+        int i = y * match_width + x;
+        r[i] = col.r;
+        g[i] = col.g;
+        b[i] = col.b;
+        a[i] = col.a;
+        moments.sum += col;
+        moments.sq_sum += col.dot(col);
+      }
+    }
+  }
 
-    while (!tasks.empty()) {
+  // Number of cells that are matched together. Their samples (~2KB per cell
+  // for typical fonts) stay in L1/L2 while the glyph matrix streams through.
+  static constexpr int kCellBatch = 16;
+  // Cells are rendered in tiles of kTileWidth × kTileHeight, one batch per
+  // tile, so that the neighbours of most cells are matched just before them
+  // by the same worker. Streamed renders use tiles of kCellBatch × 1 instead,
+  // so that the first row is done as soon as possible.
+  static constexpr int kTileWidth = 4;
+  static constexpr int kTileHeight = 4;
+  static_assert(kTileWidth * kTileHeight <= kCellBatch);
+  // Number of glyphs per block product. Bounds the size of the scratch buffer
+  // with the weighted sums.
+  static constexpr int kGlyphBlock = 64;
 
-      pthread_mutex_lock(&mut);
-      auto task = tasks.back();
-      tasks.pop_back();
-      pthread_mutex_unlock(&mut);
-      int char_x = task.char_x;
-      int char_y = task.char_y;
+  // Resolution at which the cells are sampled & compared with the glyphs.
+  // Chosen once per render by `SelectGlyphs`.
+  int match_width = 0;
+  int match_height = 0;
+  int match_stride = 0; // padded for the kernels
 
-      TaskResult result;
-      result.char_x = char_x;
-      result.char_y = char_y;
+  // Glyphs that are not in `forbidden_characters`, their moments and their
+  // rows of the glyph matrix at the matching resolution. Selected once per
+  // render by `SelectGlyphs`.
+  //
+  // Glyphs that look like one of the active glyphs are folded into it. The
+  // duplicates of a glyph are left out - they can never win, because ties go
+  // to the lower index. The complement of a glyph (e.g. ▄ for ▀) can't be
+  // left out, because only the bg may be transparent. It needs no kernel work
+  // of its own though - Σ(1 - w)·c = Σc - Σw·c - so it's stored in
+  // `active_complements` and evaluated together with the glyph.
+  std::vector<const Glyph *> active_glyphs;
+  std::vector<GlyphMoments> active_moments;
+  const float *active_coverage = nullptr;
+  std::vector<const Glyph *> active_complements; // nullptr if none
+  std::vector<GlyphMoments> complement_moments;
+  // Compacted or resampled glyph matrix, used when it differs from the one in
+  // the atlas.
+  AlignedArray<float> filtered_coverage;
 
-      float img_x_begin = char_x * img_char_width;
-      float img_x_end = (char_x + 1) * img_char_width;
-      float img_y_begin = char_y * img_char_height;
-      float img_y_end = (char_y + 1) * img_char_height;
+  void SelectGlyphs() {
+    match_width = sample_width > 0 ? sample_width : font->glyph_width;
+    match_height = sample_height > 0 ? sample_height : font->glyph_height;
+    match_stride = KernelStride(match_width * match_height);
+    bool resample = match_width != font->glyph_width ||
+                    match_height != font->glyph_height;
 
-      Glyph *best_glyph = nullptr;
-      float best_err = 999999.f;
-      vec4 best_fg;
-      vec4 best_bg;
+    std::u32string allowed = SortedCharacters(allowed_characters);
+    std::u32string forbidden = SortedCharacters(forbidden_characters);
+    std::vector<const Glyph *> selected;
+    for (auto &glyph : font->glyphs) {
+      char32_t c = glyph.unicode;
+      if ((allowed.empty() ||
+           std::binary_search(allowed.begin(), allowed.end(), c)) &&
+          !std::binary_search(forbidden.begin(), forbidden.end(), c)) {
+        selected.push_back(&glyph);
+      }
+    }
+    active_glyphs.clear();
+    active_complements.clear();
+    // Active glyph of each shape, indexed by the shape.
+    std::vector<int> shape_glyphs(font->glyphs.size(), -1);
+    for (const Glyph *glyph : selected) {
+      int index = font->Index(*glyph);
+      int shape = font->shapes[index];
+      if (shape_glyphs[shape] >= 0) {
+        continue;
+      }
+      int complement = font->complements[index];
+      if (complement >= 0 && shape_glyphs[complement] >= 0) {
+        shape_glyphs[shape] = shape_glyphs[complement];
+        active_complements[shape_glyphs[shape]] = glyph;
+        continue;
+      }
+      shape_glyphs[shape] = active_glyphs.size();
+      active_glyphs.push_back(glyph);
+      active_complements.push_back(nullptr);
+    }
+    bool filter = active_glyphs.size() != font->glyphs.size();
+    int n_active = active_glyphs.size();
+    active_moments.resize(n_active);
+    complement_moments.assign(n_active, {0, 0});
+    if (!resample) {
+      for (int i = 0; i < n_active; ++i) {
+        active_moments[i] = {active_glyphs[i]->coverage_sum,
+                             active_glyphs[i]->coverage_sq_sum};
+        if (active_complements[i]) {
+          complement_moments[i] = {active_complements[i]->coverage_sum,
+                                   active_complements[i]->coverage_sq_sum};
+        }
+      }
+      if (!filter) {
+        active_coverage = font->coverage;
+        return;
+      }
+      filtered_coverage.Resize(n_active * font->stride);
+      for (int i = 0; i < n_active; ++i) {
+        size_t row = font->Index(*active_glyphs[i]);
+        std::copy_n(&font->coverage[row * font->stride], font->stride,
+                    &filtered_coverage[i * font->stride]);
+      }
+      active_coverage = filtered_coverage.data;
+      return;
+    }
+
+    // Box filter: every sample averages the glyph pixels under it, weighted by
+    // the overlapping area. Weights are separable, so they're precomputed
+    // per axis.
+    auto box_weights = [](int src, int dst) {
+      std::vector<float> weights(dst * src, 0.f);
+      float scale = float(src) / dst;
+      for (int i = 0; i < dst; ++i) {
+        float begin = i * scale, end = (i + 1) * scale;
+        for (int j = (int)begin; j < src && j < end; ++j) {
+          float overlap = std::min(end, j + 1.f) - std::max(begin, float(j));
+          weights[i * src + j] = overlap / scale;
+        }
+      }
+      return weights;
+    };
+    std::vector<float> wx = box_weights(font->glyph_width, match_width);
+    std::vector<float> wy = box_weights(font->glyph_height, match_height);
+    std::vector<float> rows(match_height * font->glyph_width);
+    filtered_coverage.Resize(n_active * match_stride);
+    for (int i = 0; i < n_active; ++i) {
+      size_t index = font->Index(*active_glyphs[i]);
+      const float *src = &font->coverage[index * font->stride];
+      float *dst = &filtered_coverage[i * match_stride];
+      std::fill(rows.begin(), rows.end(), 0.f);
+      for (int y = 0; y < match_height; ++y) {
+        for (int sy = 0; sy < font->glyph_height; ++sy) {
+          float w = wy[y * font->glyph_height + sy];
+          if (w == 0) {
+            continue;
+          }
+          for (int sx = 0; sx < font->glyph_width; ++sx) {
+            rows[y * font->glyph_width + sx] +=
+                w * src[sy * font->glyph_width + sx];
+          }
+        }
+      }
+      GlyphMoments moments = {0, 0};
+      for (int y = 0; y < match_height; ++y) {
+        for (int x = 0; x < match_width; ++x) {
+          float w = 0;
+          for (int sx = 0; sx < font->glyph_width; ++sx) {
+            w += wx[x * font->glyph_width + sx] *
+                 rows[y * font->glyph_width + sx];
+          }
+          dst[y * match_width + x] = w;
+          moments.sum += w;
+          moments.sq_sum += w * w;
+        }
+      }
+      active_moments[i] = moments;
+      // The weights of every sample add up to 1, so the complement filters
+      // to 1 - w.
+      float n = match_width * match_height;
+      complement_moments[i] = {n - moments.sum,
+                               n - 2 * moments.sum + moments.sq_sum};
+    }
+    active_coverage = filtered_coverage.data;
+  }
+
+  // Fits the colors of active glyph `g` (and of its complement) to a cell,
+  // given Σw·c of `g`. Stores the glyph & its colors in `result` if its error
+  // is lower than `best_err` - or equal, and the glyph has a lower index.
+  // Returns true if `result` was updated.
+  bool EvaluateGlyph(int g, const CellMoments &cell, const vec4 &weighted_sum,
+                     float &best_err, TaskResult &result) {
+    bool updated = false;
+    auto evaluate = [&](const Glyph *glyph, const GlyphMoments &moments,
+                        const vec4 &weighted_sum) {
+      vec4 fg_col, bg_col;
+      float error = SolveColors(moments, cell, weighted_sum, fg_col, bg_col);
+      if (error < best_err || (error == best_err && glyph < result.glyph)) {
+        best_err = error;
+        result.glyph = glyph;
+        result.fg = fg_col;
+        result.bg = bg_col;
+        updated = true;
+      }
+    };
+    evaluate(active_glyphs[g], active_moments[g], weighted_sum);
+    if (active_complements[g]) {
+      evaluate(active_complements[g], complement_moments[g],
+               cell.sum - weighted_sum);
+    }
+    return updated;
+  }
+
+  // Number of chunks of `kKernelLanes` samples (one or two rows) in a cell.
+  int n_chunks = 0;
+  // The bounded search checks the glyphs after every `check_chunks` chunks.
+  // A check costs about as much as evaluating a few chunks, so the glyphs are
+  // only checked after each third of the rows.
+  static constexpr int kBoundChecks = 3;
+  int check_chunks = 1;
+
+  // Lower bounds used by the bounded search. After the first `k + 1` chunks
+  // of a glyph, with `p` = Σw·c and `s` = Σc over these samples, the error
+  // is at least the sum of:
+  // - in r, g & b: the error of the unconstrained least-squares fit of fg &
+  //   bg to these samples, Σ|c|² - (n·|p|² - 2·Σw·p·s + Σw²·|s|²) / det,
+  //   where det = n·Σw² - (Σw)²,
+  // - in alpha: the error of the better of the two alpha models that
+  //   SolveColors produces - opaque fg with either opaque or transparent bg.
+  // Adding samples or constraining the colors can only increase the error.
+  struct GlyphBound {
+    bool fit;          // false when the coverage is nearly uniform & the
+                       // least-squares fit is ill-conditioned
+    double pp, ps, ss; // coefficients of |p|², p·s & |s|² in the fit error
+    double sq_sum;     // Σw²
+  };
+  // Bounds of every active glyph, at `glyph_bounds[g * n_chunks + k]`, and
+  // of its complement at the same place in `complement_bounds`.
+  std::vector<GlyphBound> glyph_bounds;
+  std::vector<GlyphBound> complement_bounds;
+
+  struct CellBound {
+    double rgb_sq_sum; // Σ(c.r² + c.g² + c.b²)
+    double sum[4];     // Σc
+    double ss;         // |s|² (r, g & b only)
+    double alpha_sq_sum;
+    double opaque_bg; // alpha error of an opaque bg
+  };
+
+  void PrepareGlyphBounds() {
+    n_chunks = match_stride / kKernelLanes;
+    check_chunks = (n_chunks + kBoundChecks - 1) / kBoundChecks;
+    int n_samples = match_width * match_height;
+    int n_active = active_glyphs.size();
+    glyph_bounds.resize(n_active * n_chunks);
+    complement_bounds.resize(n_active * n_chunks);
+    auto make_bound = [](double n, double w, double w2) -> GlyphBound {
+      double det = n * w2 - w * w;
+      if (det > 1e-3 * n * n) {
+        return {true, n / det, 2 * w / det, w2 / det, w2};
+      } else if (w2 == w) {
+        // Coverage is either all 0 or all 1, so a single color fits best.
+        return {true, 0, 0, 1 / n, w2};
+      }
+      return {false, 0, 0, 0, w2};
+    };
+    for (int g = 0; g < n_active; ++g) {
+      const float *coverage = active_coverage + g * match_stride;
+      double w = 0, w2 = 0;
+      for (int k = 0; k < n_chunks; ++k) {
+        for (int i = k * kKernelLanes; i < (k + 1) * kKernelLanes; ++i) {
+          w += coverage[i];
+          w2 += coverage[i] * coverage[i];
+        }
+        double n = std::min((k + 1) * kKernelLanes, n_samples);
+        glyph_bounds[g * n_chunks + k] = make_bound(n, w, w2);
+        // Σ(1 - w) & Σ(1 - w)²
+        complement_bounds[g * n_chunks + k] =
+            make_bound(n, n - w, n - 2 * w + w2);
+      }
+    }
+  }
+
+  // Computed in double precision, because the terms cancel out.
+  static double ErrorBound(const GlyphBound &glyph, const CellBound &cell,
+                           const float p[4]) {
+    double rgb = 0;
+    if (glyph.fit) {
+      double pp = 0, ps = 0;
+      for (int c = 0; c < 3; ++c) {
+        pp += (double)p[c] * p[c];
+        ps += p[c] * cell.sum[c];
+      }
+      rgb = cell.rgb_sq_sum -
+            (glyph.pp * pp - glyph.ps * ps + glyph.ss * cell.ss);
+    }
+    double transparent_bg = cell.alpha_sq_sum - 2 * p[3] + glyph.sq_sum;
+    return std::max(0., rgb) +
+           std::max(0., std::min(cell.opaque_bg, transparent_bg));
+  }
+
+  // Per-worker state of the bounded search.
+  struct SearchOrder {
+    std::vector<int> glyphs; // indices of the active glyphs, in search order
+    std::vector<int> wins;   // number of cells won by each active glyph
+    std::vector<CellBound> cell_bounds; // of the chunks of the current cell
+  };
+
+  // Bounded version of `MatchCells`. The glyphs are evaluated a few rows at a
+  // time and dropped as soon as their error bound exceeds the best error. The
+  // margin covers the rounding errors of SolveColors (which grow with the
+  // number of samples), so the results are the same. Ties are resolved in
+  // favor of the lower index, like in the exhaustive search.
+  bool MatchCellsBounded(const float *cells, const CellMoments *moments,
+                         int n_cells, TaskResult *results,
+                         SearchOrder &order) {
+    int n_samples = match_width * match_height;
+    order.cell_bounds.resize(n_chunks);
+    int winners[kCellBatch];
+    for (int c = 0; c < n_cells; ++c) {
+      if (cancelled.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      const float *planes = cells + c * 4 * match_stride;
+      double sum[4] = {}, rgb_sq_sum = 0, alpha_sq_sum = 0;
+      for (int k = 0; k < n_chunks; ++k) {
+        for (int i = k * kKernelLanes; i < (k + 1) * kKernelLanes; ++i) {
+          for (int ch = 0; ch < 4; ++ch) {
+            sum[ch] += planes[ch * match_stride + i];
+          }
+          for (int ch = 0; ch < 3; ++ch) {
+            rgb_sq_sum += planes[ch * match_stride + i] *
+                          planes[ch * match_stride + i];
+          }
+          alpha_sq_sum += planes[3 * match_stride + i] *
+                          planes[3 * match_stride + i];
+        }
+        double n = std::min((k + 1) * kKernelLanes, n_samples);
+        order.cell_bounds[k] = {
+            rgb_sq_sum,
+            {sum[0], sum[1], sum[2], sum[3]},
+            sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2],
+            alpha_sq_sum,
+            alpha_sq_sum - 2 * sum[3] + n};
+      }
+      float margin = 4 * sqrtf(moments[c].n) * FLT_EPSILON *
+                     (moments[c].sq_sum + moments[c].n);
 
-      for (auto &glyph : font.glyphs) {
-        if (forbidden_characters.find(glyph.utf8) != std::string::npos)
+      float best_err = 999999.f;
+      int best = -1;
+      results[c].glyph = nullptr;
+      // The glyphs of the neighbours matched earlier in this tile are tried
+      // first. Neighbouring cells often look alike, so they usually give a
+      // tight bound right away.
+      int seeds[2];
+      int n_seeds = 0;
+      for (int d = 0; d < c; ++d) {
+        int dx = results[c].char_x - results[d].char_x;
+        int dy = results[c].char_y - results[d].char_y;
+        if (dx + dy == 1 && dx >= 0 && dy >= 0 &&
+            (n_seeds == 0 || seeds[0] != winners[d])) {
+          seeds[n_seeds++] = winners[d];
+        }
+      }
+      auto evaluate = [&](int g) {
+        const float *coverage = active_coverage + g * match_stride;
+        float lanes[4 * kKernelLanes] = {};
+        float sums[4];
+        bool pruned = false;
+        for (int begin = 0; begin < n_chunks; begin += check_chunks) {
+          int end = std::min(begin + check_chunks, n_chunks);
+          kernel.accumulate_weighted_sums(coverage, planes, match_stride,
+                                          begin * kKernelLanes,
+                                          end * kKernelLanes, lanes, sums);
+          if (end == n_chunks) {
+            break;
+          }
+          const CellBound &cell = order.cell_bounds[end - 1];
+          if (ErrorBound(glyph_bounds[g * n_chunks + end - 1], cell, sums) <=
+              best_err + margin) {
+            continue;
+          }
+          if (active_complements[g]) {
+            // The complement has Σ(1 - w)·c = Σc - Σw·c.
+            float complement_sums[4];
+            for (int ch = 0; ch < 4; ++ch) {
+              complement_sums[ch] = cell.sum[ch] - sums[ch];
+            }
+            if (ErrorBound(complement_bounds[g * n_chunks + end - 1], cell,
+                           complement_sums) <= best_err + margin) {
+              continue;
+            }
+          }
+          pruned = true;
+          break;
+        }
+        if (pruned) {
+          return;
+        }
+        vec4 weighted_sum(sums[0], sums[1], sums[2], sums[3]);
+        if (EvaluateGlyph(g, moments[c], weighted_sum, best_err,
+                          results[c])) {
+          best = g;
+        }
+      };
+      for (int i = 0; i < n_seeds; ++i) {
+        evaluate(seeds[i]);
+      }
+      int n_glyphs = order.glyphs.size();
+      for (int i = 0; i < n_glyphs; ++i) {
+        // Checked as often as in the exhaustive search, because a single cell
+        // can take a scan of all of the glyphs.
+        if (i % kGlyphBlock == kGlyphBlock - 1 &&
+            cancelled.load(std::memory_order_relaxed)) {
+          return false;
+        }
+        int g = order.glyphs[i];
+        if ((n_seeds > 0 && g == seeds[0]) || (n_seeds > 1 && g == seeds[1])) {
           continue;
-        float fg_sum = 0;
-        vec4 fg_col = {};
-        float bg_sum = 0;
-        vec4 bg_col = {};
-        for (int font_char_x = 0; font_char_x < font.glyph_width;
-             ++font_char_x) {
-          for (int font_char_y = 0; font_char_y < font.glyph_height;
-               ++font_char_y) {
-            float fg =
-                glyph.pixels[font_char_x + font_char_y * font.glyph_width] /
-                255.f;
-            float bg = 1.f - fg;
-            fg_sum += fg;
-            bg_sum += bg;
-            float img_x = img_x_begin + img_char_width * (font_char_x + 0.5f) /
-                                            font.glyph_width;
-            float img_y = img_y_begin + img_char_height * (font_char_y + 0.5f) /
-                                            font.glyph_height;
-            vec4 col = image.Read(img_x, img_y);
-            fg_col += col * fg;
-            bg_col += col * bg;
+        }
+        evaluate(g);
+      }
+      winners[c] = best;
+      ++order.wins[best];
+    }
+    // Tighter bounds come sooner when the likely winners go first.
+    std::stable_sort(
+        order.glyphs.begin(), order.glyphs.end(),
+        [&](int a, int b) { return order.wins[a] > order.wins[b]; });
+    return true;
+  }
+
+  // Shape index of the active glyphs. Rebuilt by `PrepareGlyphIndex` when
+  // the active glyphs or the matching resolution change.
+  GlyphIndex index;
+  std::shared_ptr<const FontAtlasImpl> indexed_font;
+  std::vector<const Glyph *> indexed_glyphs;
+  int indexed_width = 0;
+  int indexed_height = 0;
+
+  void PrepareGlyphIndex() {
+    if (indexed_font == font && indexed_glyphs == active_glyphs &&
+        indexed_width == match_width && indexed_height == match_height) {
+      return;
+    }
+    index.Build(active_coverage, active_glyphs.size(),
+                match_width * match_height, match_stride);
+    indexed_font = font;
+    indexed_glyphs = active_glyphs;
+    indexed_width = match_width;
+    indexed_height = match_height;
+  }
+
+  // Approximate version of `MatchCells`. The samples of a cell are projected
+  // onto the principal axis of their colors, which turns the cell into a
+  // single-channel pattern. Only the glyphs whose shapes are closest to that
+  // pattern are evaluated (exactly).
+  bool MatchCellsApproximate(const float *cells, const CellMoments *moments,
+                             int n_cells, TaskResult *results,
+                             std::vector<int> &candidates) {
+    int n_samples = match_width * match_height;
+    // At least one glyph per cell, even if none of them is uniform.
+    int k = std::max(search_candidates, 1);
+    std::vector<float> pattern(n_samples);
+    for (int c = 0; c < n_cells; ++c) {
+      if (cancelled.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      const float *planes = cells + c * 4 * match_stride;
+      // Scatter matrix of the sample colors.
+      const vec4 &sum = moments[c].sum;
+      double mean[4] = {sum.r / n_samples, sum.g / n_samples,
+                        sum.b / n_samples, sum.a / n_samples};
+      double scatter[4][4] = {};
+      for (int s = 0; s < n_samples; ++s) {
+        double d[4];
+        for (int i = 0; i < 4; ++i) {
+          d[i] = planes[i * match_stride + s] - mean[i];
+        }
+        for (int i = 0; i < 4; ++i) {
+          for (int j = i; j < 4; ++j) {
+            scatter[i][j] += d[i] * d[j];
+          }
+        }
+      }
+      // Power iteration, starting from the channel that varies the most.
+      int widest = 0;
+      for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < i; ++j) {
+          scatter[i][j] = scatter[j][i];
+        }
+        if (scatter[i][i] > scatter[widest][widest]) {
+          widest = i;
+        }
+      }
+      double axis[4];
+      for (int i = 0; i < 4; ++i) {
+        axis[i] = scatter[i][widest];
+      }
+      for (int iteration = 0; iteration < 8; ++iteration) {
+        double next[4] = {}, norm = 0;
+        for (int i = 0; i < 4; ++i) {
+          for (int j = 0; j < 4; ++j) {
+            next[i] += scatter[i][j] * axis[j];
           }
+          norm += next[i] * next[i];
+        }
+        if (norm < 1e-30) {
+          break;
+        }
+        norm = 1 / sqrt(norm);
+        for (int i = 0; i < 4; ++i) {
+          axis[i] = next[i] * norm;
+        }
+      }
+      for (int s = 0; s < n_samples; ++s) {
+        double t = 0;
+        for (int i = 0; i < 4; ++i) {
+          t += axis[i] * planes[i * match_stride + s];
+        }
+        pattern[s] = t;
+      }
+      index.Query(pattern.data(), k, candidates);
+
+      float best_err = 999999.f;
+      results[c].glyph = nullptr;
+      for (int g : candidates) {
+        float lanes[4 * kKernelLanes] = {};
+        float sums[4];
+        kernel.accumulate_weighted_sums(active_coverage + g * match_stride,
+                                        planes, match_stride, 0, match_stride,
+                                        lanes, sums);
+        vec4 weighted_sum(sums[0], sums[1], sums[2], sums[3]);
+        EvaluateGlyph(g, moments[c], weighted_sum, best_err, results[c]);
+      }
+    }
+    return true;
+  }
+
+  // 1-bit glyph bitmaps at the matching resolution, `mask_words` words per
+  // glyph. Sample `i` is bit `i % 64` of word `i / 64`; it's set where the
+  // coverage is at least one half.
+  int mask_words = 0;
+  std::vector<uint64_t> glyph_masks;
+
+  void PrepareGlyphMasks() {
+    int n_samples = match_width * match_height;
+    int n_glyphs = active_glyphs.size();
+    mask_words = (n_samples + 63) / 64;
+    glyph_masks.assign(n_glyphs * mask_words, 0);
+    for (int g = 0; g < n_glyphs; ++g) {
+      const float *coverage = active_coverage + g * match_stride;
+      uint64_t *mask = &glyph_masks[g * mask_words];
+      for (int i = 0; i < n_samples; ++i) {
+        if (coverage[i] >= 0.5f) {
+          mask[i / 64] |= uint64_t(1) << (i % 64);
         }
-        if (fg_sum) {
-          fg_col /= fg_sum;
+      }
+    }
+  }
+
+  // Splits the samples of a cell into two color clusters (2-means) and
+  // stores the cluster of every sample in `mask`, in the layout of
+  // `glyph_masks`. Uniform cells end up with an empty mask. `next` is scratch
+  // space for another mask.
+  void ClusterCell(const float *planes, uint64_t *mask, uint64_t *next) {
+    int n_samples = match_width * match_height;
+    // Returns the sample farthest from `color`.
+    auto farthest = [&](const float color[4]) {
+      int farthest = 0;
+      float farthest_dist = -1;
+      for (int i = 0; i < n_samples; ++i) {
+        float dist = 0;
+        for (int ch = 0; ch < 4; ++ch) {
+          float d = planes[ch * match_stride + i] - color[ch];
+          dist += d * d;
         }
-        fg_col.a = 1;
-        if (bg_sum) {
-          bg_col /= bg_sum;
+        if (dist > farthest_dist) {
+          farthest_dist = dist;
+          farthest = i;
+        }
+      }
+      return farthest;
+    };
+    // Seeds: the sample farthest from the first one, and the sample farthest
+    // from that.
+    float centers[2][4];
+    int seeds[2];
+    for (int ch = 0; ch < 4; ++ch) {
+      centers[0][ch] = planes[ch * match_stride];
+    }
+    seeds[1] = farthest(centers[0]);
+    for (int ch = 0; ch < 4; ++ch) {
+      centers[1][ch] = planes[ch * match_stride + seeds[1]];
+    }
+    seeds[0] = farthest(centers[1]);
+    for (int ch = 0; ch < 4; ++ch) {
+      centers[0][ch] = planes[ch * match_stride + seeds[0]];
+    }
+    std::fill_n(mask, mask_words, 0);
+    if (seeds[0] == seeds[1]) {
+      return;
+    }
+    float total[4];
+    for (int ch = 0; ch < 4; ++ch) {
+      const float *plane = planes + ch * match_stride;
+      total[ch] = std::accumulate(plane, plane + n_samples, 0.f);
+    }
+    for (int iteration = 0; iteration < 8; ++iteration) {
+      // A sample is closer to center 1 iff it's on its side of the plane
+      // halfway between the centers: x·(c1 - c0) > (|c1|² - |c0|²) / 2.
+      float normal[4];
+      float threshold = 0;
+      for (int ch = 0; ch < 4; ++ch) {
+        normal[ch] = centers[1][ch] - centers[0][ch];
+        threshold += (centers[1][ch] * centers[1][ch] -
+                      centers[0][ch] * centers[0][ch]) / 2;
+      }
+      float sums[4] = {};
+      int count = 0;
+      for (int w = 0; w < mask_words; ++w) {
+        uint64_t bits = 0;
+        int end = std::min(64, n_samples - w * 64);
+        for (int j = 0; j < end; ++j) {
+          int i = w * 64 + j;
+          float r = planes[i], g = planes[match_stride + i],
+                b = planes[2 * match_stride + i],
+                a = planes[3 * match_stride + i];
+          bool side = r * normal[0] + g * normal[1] + b * normal[2] +
+                          a * normal[3] >
+                      threshold;
+          bits |= uint64_t(side) << j;
+          float weight = side;
+          sums[0] += r * weight;
+          sums[1] += g * weight;
+          sums[2] += b * weight;
+          sums[3] += a * weight;
+          count += side;
         }
-        if (bg_col.a < 0.2) {
-          bg_col.a = 0;
-        } else {
-          bg_col.a = 1;
+        next[w] = bits;
+      }
+      if (std::equal(next, next + mask_words, mask) || count == 0 ||
+          count == n_samples) {
+        break;
+      }
+      std::copy_n(next, mask_words, mask);
+      for (int ch = 0; ch < 4; ++ch) {
+        centers[1][ch] = sums[ch] / count;
+        centers[0][ch] = (total[ch] - sums[ch]) / (n_samples - count);
+      }
+    }
+  }
+
+  // Binary version of `MatchCells`. Glyphs are compared with the cluster
+  // mask of the cell by their Hamming distance, in either polarity - the
+  // fg & bg can be swapped. The colors are fitted for every glyph tied at
+  // the lowest distance, and the one that fits best wins.
+  bool MatchCellsBinary(const float *cells, const CellMoments *moments,
+                        int n_cells, TaskResult *results,
+                        std::vector<int> &distances) {
+    int n_samples = match_width * match_height;
+    int n_glyphs = active_glyphs.size();
+    distances.resize(n_glyphs);
+    std::vector<uint64_t> masks(2 * mask_words);
+    uint64_t *mask = masks.data();
+    for (int c = 0; c < n_cells; ++c) {
+      if (cancelled.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      const float *planes = cells + c * 4 * match_stride;
+      ClusterCell(planes, mask, mask + mask_words);
+      MaskDistances(glyph_masks.data(), n_glyphs, mask_words, mask,
+                    distances.data());
+      int best_distance = n_samples;
+      for (int &distance : distances) {
+        distance = std::min(distance, n_samples - distance);
+        best_distance = std::min(best_distance, distance);
+      }
+      float best_err = 999999.f;
+      results[c].glyph = nullptr;
+      for (int g = 0; g < n_glyphs; ++g) {
+        if (distances[g] != best_distance) {
+          continue;
         }
-        bg_col *= bg_col.a; // premultiply
+        float sums[4];
+        kernel.weighted_sum(active_coverage + g * match_stride, planes,
+                            match_stride, sums);
+        vec4 weighted_sum(sums[0], sums[1], sums[2], sums[3]);
+        EvaluateGlyph(g, moments[c], weighted_sum, best_err, results[c]);
+      }
+    }
+    return true;
+  }
 
-        float error = 0;
-        for (int font_char_x = 0; font_char_x < font.glyph_width;
-             ++font_char_x) {
-          for (int font_char_y = 0; font_char_y < font.glyph_height;
-               ++font_char_y) {
+  // Finds the best glyph & colors for each of the `n_cells` sampled cells.
+  // Returns false if the render was cancelled in the meantime.
+  bool MatchCells(const float *cells, const CellMoments *moments, int n_cells,
+                  TaskResult *results, float *sums) {
+    float best_err[kCellBatch];
+    for (int c = 0; c < n_cells; ++c) {
+      best_err[c] = 999999.f;
+      results[c].glyph = nullptr;
+    }
+    int n_glyphs = active_glyphs.size();
+    for (int g0 = 0; g0 < n_glyphs; g0 += kGlyphBlock) {
+      if (cancelled.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      int block = std::min(kGlyphBlock, n_glyphs - g0);
+      // The only glyph-dependent image statistic is Σw·c. Everything else
+      // comes from the precomputed glyph & cell moments.
+      kernel.block_weighted_sums(active_coverage + g0 * match_stride, block,
+                                 cells, n_cells, match_stride, sums);
+      for (int g = 0; g < block; ++g) {
+        for (int c = 0; c < n_cells; ++c) {
+          const float *s = sums + (c * block + g) * 4;
+          vec4 weighted_sum(s[0], s[1], s[2], s[3]);
+          EvaluateGlyph(g0 + g, moments[c], weighted_sum, best_err[c],
+                        results[c]);
+        }
+      }
+    }
+    return true;
+  }
+
+  void RenderWorker() {
+    Pixel *result_rgba = (Pixel *)&result_rgba_bytes[0];
+    AlignedArray<float> cells;
+    cells.Resize(kCellBatch * 4 * match_stride);
+    AlignedArray<float> sums;
+    sums.Resize(kCellBatch * kGlyphBlock * 4);
+    CellMoments moments[kCellBatch];
+    TaskResult results[kCellBatch];
+    SearchOrder order;
+    if (glyph_search == GlyphSearch::kBounded) {
+      order.glyphs.resize(active_glyphs.size());
+      std::iota(order.glyphs.begin(), order.glyphs.end(), 0);
+      order.wins.assign(active_glyphs.size(), 0);
+    }
+    std::vector<int> candidates; // or mask distances in kBinary
+
+    int n_tasks = tasks.size();
+    int n_batches = batches.size() - 1;
+    while (true) {
+      int batch = next_batch.fetch_add(1, std::memory_order_relaxed);
+      if (batch >= n_batches) {
+        break;
+      }
+      int first = batches[batch];
+      int n_cells = batches[batch + 1] - first;
+      for (int c = 0; c < n_cells; ++c) {
+        results[c].char_x = tasks[first + c].char_x;
+        results[c].char_y = tasks[first + c].char_y;
+      }
+
+      for (int c = 0; c < n_cells; ++c) {
+        SampleCell(results[c].char_x, results[c].char_y,
+                   &cells[c * 4 * match_stride], moments[c]);
+      }
+      bool matched;
+      switch (glyph_search) {
+      case GlyphSearch::kBounded:
+        matched =
+            MatchCellsBounded(cells.data, moments, n_cells, results, order);
+        break;
+      case GlyphSearch::kApproximate:
+        matched = MatchCellsApproximate(cells.data, moments, n_cells, results,
+                                        candidates);
+        break;
+      case GlyphSearch::kBinary:
+        matched = MatchCellsBinary(cells.data, moments, n_cells, results,
+                                   candidates);
+        break;
+      default:
+        matched = MatchCells(cells.data, moments, n_cells, results, sums.data);
+      }
+      if (!matched) {
+        break;
+      }
+
+      // Blit the characters onto result_rgba_bytes
+      for (int c = 0; c < n_cells; ++c) {
+        TaskResult &result = results[c];
+        task_results[result.char_y * width + result.char_x] = result;
+        const uint8_t *glyph_pixels = font->Pixels(*result.glyph);
+        for (int font_char_y = 0; font_char_y < font->glyph_height;
+             ++font_char_y) {
+          for (int font_char_x = 0; font_char_x < font->glyph_width;
+               ++font_char_x) {
+            int result_x = result.char_x * font->glyph_width + font_char_x;
+            int result_y = result.char_y * font->glyph_height + font_char_y;
+            Pixel &result_pixel =
+                result_rgba[result_x + result_y * result_rgba_width];
             float fg =
-                glyph.pixels[font_char_x + font_char_y * font.glyph_width] /
+                glyph_pixels[font_char_x + font_char_y * font->glyph_width] /
                 255.f;
             float bg = 1.f - fg;
-            float img_x = img_x_begin + img_char_width * (font_char_x + 0.5f) /
-                                            font.glyph_width;
-            float img_y = img_y_begin + img_char_height * (font_char_y + 0.5f) /
-                                            font.glyph_height;
-            vec4 col = image.Read(img_x, img_y);
-            col *= col.a; // premultiply
-            vec4 x = fg_col * fg + bg_col * bg;
-            vec4 d = col - x;
-            error += (d * d).sum();
+            result_pixel = (result.fg * fg + result.bg * bg).pixel();
           }
         }
-        if (error < best_err) {
-          best_err = error;
-          best_glyph = &glyph;
-          best_fg = fg_col;
-          best_bg = bg_col;
-        }
       }
+      // Cells of a tile are stored row by row.
+      for (int c = 0, n = 1; c < n_cells; c += n, n = 1) {
+        while (c + n < n_cells && results[c + n].char_y == results[c].char_y)
+          ++n;
+        FinishCells(results[c].char_y, n);
+      }
+      int done = tasks_done.fetch_add(n_cells, std::memory_order_relaxed);
+      progress = (done + n_cells) / float(n_tasks + 1);
+    }
+  }
 
-      result.fg = best_fg;
-      result.bg = best_bg;
-      result.glyph = best_glyph;
+  // Returns row `char_y` of `result_raw`, including the trailing newline.
+  std::string EncodeRow(int char_y) {
+    std::string row;
+    std::string last_bg = ansi::kResetBG;
+    std::string last_fg = ansi::kResetFG;
+    for (int char_x = 0; char_x < width; ++char_x) {
+      TaskResult &result = task_results[char_y * width + char_x];
+      std::string new_bg =
+          result.bg.a < 0.5 ? ansi::kResetBG : result.bg.pixel().AnsiBg();
+      if (new_bg != last_bg) {
+        row += new_bg;
+        last_bg = new_bg;
+      }
+      std::string new_fg = result.glyph->unicode == 32
+                               ? ansi::kResetFG
+                               : result.fg.pixel().AnsiFg();
+      if (new_fg != last_fg) {
+        row += new_fg;
+        last_fg = new_fg;
+      }
+      row += result.glyph->utf8;
+    }
+    if (last_bg != ansi::kResetBG) {
+      row += ansi::kResetBG;
+    }
+    if (last_fg != ansi::kResetFG) {
+      row += ansi::kResetFG;
+    }
+    // Remove trailing whitespace
+    while (row.ends_with(" ")) {
+      row.pop_back();
+    }
+    row += "\n";
+    return row;
+  }
 
-      pthread_mutex_lock(&mut);
-      task_results.push_back(result);
-      progress =
-          task_results.size() / float(task_results.size() + tasks.size() + 1);
-      pthread_mutex_unlock(&mut);
+  // Number of finished cells in each row.
+  std::unique_ptr<std::atomic<int>[]> row_progress;
+  // Rows of `result_raw`, filled in as soon as all of their cells are done.
+  std::vector<std::string> encoded_rows;
+  // Guards the fields below & serializes the calls to `on_row`.
+  pthread_mutex_t stream_mut = PTHREAD_MUTEX_INITIALIZER;
+  int rows_encoded = 0;
+  int rows_held_back = 0; // empty rows not passed to `on_row` yet
+  bool row_streamed = false;
 
-      // Blit the character onto result_rgba_bytes
-      for (int font_char_x = 0; font_char_x < font.glyph_width; ++font_char_x) {
-        for (int font_char_y = 0; font_char_y < font.glyph_height;
-             ++font_char_y) {
-          int result_x = char_x * font.glyph_width + font_char_x;
-          int result_y = char_y * font.glyph_height + font_char_y;
-          Pixel &result_pixel =
-              result_rgba[result_x + result_y * result_rgba_width];
-          float fg =
-              best_glyph->pixels[font_char_x + font_char_y * font.glyph_width] /
-              255.f;
-          float bg = 1.f - fg;
-          result_pixel = (best_fg * fg + best_bg * bg).pixel();
-        }
+  // Called after the cells of `char_y` were stored in `task_results`.
+  void FinishCells(int char_y, int n_cells) {
+    int done = row_progress[char_y].fetch_add(n_cells) + n_cells;
+    if (done < width) {
+      return;
+    }
+    // Encodes the completed rows in order. Whichever worker completes the
+    // first missing row also takes care of the completed rows below it.
+    int height = encoded_rows.size();
+    pthread_mutex_lock(&stream_mut);
+    while (rows_encoded < height &&
+           row_progress[rows_encoded].load() == width) {
+      std::string &row = encoded_rows[rows_encoded];
+      row = EncodeRow(rows_encoded);
+      ++rows_encoded;
+      if (!on_row) {
+        continue;
+      }
+      // Empty rows at the end are trimmed from `result_raw`, so they're held
+      // back until we know whether anything follows them.
+      if (row == "\n") {
+        ++rows_held_back;
+        continue;
+      }
+      for (; rows_held_back > 0; --rows_held_back) {
+        on_row("\n");
       }
-      pthread_testcancel();
+      on_row(row);
+      row_streamed = true;
     }
+    pthread_mutex_unlock(&stream_mut);
   }
 
   void Render() override {
+    cancelled = false;
+    RenderImpl();
+  }
 
+  void RenderImpl() {
     result_raw = "";
     result_rgba_bytes.clear();
     result_c = "";
     result_bash = "";
+    if (!font) {
+      return;
+    }
+    if (!allowed_characters.empty()) {
+      // Lazily loaded atlases only have the glyphs that were asked for so far.
+      // Failures leave the current glyphs in place.
+      std::string error;
+      auto atlas = font->AddCharacters(allowed_characters, error);
+      if (atlas && atlas != font) {
+        SetFontAtlas(atlas);
+      }
+    }
 
-    float fheight = float(image.height) * width / image.width / font.aspect;
+    float fheight = float(image.height) * width / image.width / font->aspect;
     float img_char_width = float(image.width) / width;
     float img_char_height = float(image.height) / fheight;
     int height = (int)ceil(fheight);
 
     int n_chars = width * height;
 
-    result_rgba_width = width * font.glyph_width;
-    result_rgba_height = height * font.glyph_height;
+    SelectGlyphs();
+    if (active_glyphs.empty()) {
+      return; // the font has none of the allowed, non-forbidden characters
+    }
+    if (glyph_search == GlyphSearch::kBounded) {
+      PrepareGlyphBounds();
+    } else if (glyph_search == GlyphSearch::kApproximate) {
+      PrepareGlyphIndex();
+    } else if (glyph_search == GlyphSearch::kBinary) {
+      PrepareGlyphMasks();
+    }
+    PrepareSampling(height, img_char_width, img_char_height);
+
+    result_rgba_width = width * font->glyph_width;
+    result_rgba_height = height * font->glyph_height;
     result_rgba_bytes.resize(result_rgba_width * result_rgba_height * 4);
     Pixel *result_rgba = (Pixel *)&result_rgba_bytes[0];
 
-    task_results.clear();
-    tasks.clear();
+    task_results.assign(n_chars, TaskResult());
+    encoded_rows.assign(height, "");
+    row_progress.reset(new std::atomic<int>[height]);
     for (int char_y = 0; char_y < height; ++char_y) {
-      for (int char_x = 0; char_x < width; ++char_x) {
-        tasks.push_back({char_x, char_y});
+      row_progress[char_y] = 0;
+    }
+    rows_encoded = 0;
+    rows_held_back = 0;
+    row_streamed = false;
+    // Tiles are identified by their top-left cells.
+    int tile_width = on_row ? kCellBatch : kTileWidth;
+    int tile_height = on_row ? 1 : kTileHeight;
+    std::vector<Task> tiles;
+    for (int char_y = 0; char_y < height; char_y += tile_height) {
+      for (int char_x = 0; char_x < width; char_x += tile_width) {
+        tiles.push_back({char_x, char_y});
       }
     }
 
-    std::sort(tasks.begin(), tasks.end(), [&](Task &a, Task &b) {
-      auto dist = [&](Task &t) {
-        float dx = t.char_x - (float)(width) / 2;
-        float dy = t.char_y - fheight / 2;
-        return dx * dx / font.aspect + dy * dy * font.aspect;
-      };
-      float da = dist(a);
-      float db = dist(b);
-      if (da == db) {
-        if (a.char_x == b.char_x) {
-          return a.char_y < b.char_y;
+    // Tiles closest to the center are rendered first - unless the rows are
+    // streamed. Then they're rendered top to bottom.
+    if (!on_row) {
+      std::sort(tiles.begin(), tiles.end(), [&](Task &a, Task &b) {
+        auto dist = [&](Task &t) {
+          float dx = t.char_x + tile_width / 2.f - (float)(width) / 2;
+          float dy = t.char_y + tile_height / 2.f - fheight / 2;
+          return dx * dx / font->aspect + dy * dy * font->aspect;
+        };
+        float da = dist(a);
+        float db = dist(b);
+        if (da == db) {
+          if (a.char_x == b.char_x) {
+            return a.char_y > b.char_y;
+          }
+          return a.char_x > b.char_x;
         }
-        return a.char_x < b.char_x;
-      }
-      return da > db;
-    });
-
-    workers.resize(worker_count);
-    for (int i = 0; i < worker_count; ++i) {
-      pthread_create(&workers[i], nullptr, RenderWorkerThread, this);
+        return da < db;
+      });
     }
-    bool cancelled = false;
-    for (int i = 0; i < worker_count; ++i) {
-      void* ret = nullptr;
-      pthread_join(workers[i], &ret);
-      if (ret == PTHREAD_CANCELED) {
-        cancelled = true;
+    tasks.clear();
+    batches.clear();
+    for (Task &tile : tiles) {
+      batches.push_back(tasks.size());
+      int end_y = std::min(tile.char_y + tile_height, height);
+      int end_x = std::min(tile.char_x + tile_width, width);
+      for (int char_y = tile.char_y; char_y < end_y; ++char_y) {
+        for (int char_x = tile.char_x; char_x < end_x; ++char_x) {
+          tasks.push_back({char_x, char_y});
+        }
       }
     }
-    workers.clear();
+    batches.push_back(tasks.size());
+    next_batch = 0;
+    tasks_done = 0;
+
+    pool.Reserve(worker_count);
+    pool.Run(worker_count, [this](int) { RenderWorker(); });
 
     if (cancelled) {
       tasks.clear();
@@ -428,44 +1448,13 @@ class AnsiArtImpl : public AnsiArt {
       bzero(result_rgba_bytes.data(), result_rgba_bytes.size());
       return;
     }
-
-    TaskResult *result_idx[height][width];
-    for (auto &result : task_results) {
-      result_idx[result.char_y][result.char_x] = &result;
+    if (on_row && !row_streamed) {
+      on_row("\n"); // `result_raw` always has at least one line
     }
 
+    result_raw = "";
     for (int char_y = 0; char_y < height; ++char_y) {
-      std::string last_bg = ansi::kResetBG;
-      std::string last_fg = ansi::kResetFG;
-      for (int char_x = 0; char_x < width; ++char_x) {
-        TaskResult &result = *result_idx[char_y][char_x];
-        std::string new_bg = result.bg.a < 0.5
-                                 ? ansi::kResetBG
-                                 : result.bg.pixel().AnsiBg();
-        if (new_bg != last_bg) {
-          result_raw += new_bg;
-          last_bg = new_bg;
-        }
-        std::string new_fg = result.glyph->unicode == 32
-                                 ? ansi::kResetFG
-                                 : result.fg.pixel().AnsiFg();
-        if (new_fg != last_fg) {
-          result_raw += new_fg;
-          last_fg = new_fg;
-        }
-        result_raw += result.glyph->utf8;
-      }
-      if (last_bg != ansi::kResetBG) {
-        result_raw += ansi::kResetBG;
-      }
-      if (last_fg != ansi::kResetFG) {
-        result_raw += ansi::kResetFG;
-      }
-      // Remove trailing whitespace
-      while (result_raw.ends_with(" ")) {
-        result_raw.pop_back();
-      }
-      result_raw += "\n";
+      result_raw += encoded_rows[char_y];
     }
     // Remove empty newlines at the end
     while (result_raw.ends_with("\n\n")) {
@@ -486,30 +1475,34 @@ class AnsiArtImpl : public AnsiArt {
     result_bash = "echo -ne '" + result_bash + "'";
   }
 
-  static void *RenderMasterThread(void *arg) {
-    auto self = (AnsiArtImpl *)arg;
-    self->Render();
-    self->progress = 1;
-    self->renderer = 0;
-    pthread_exit(nullptr);
-  }
-
   void StartRender(int n_threads) override {
-    worker_count = n_threads;
-    progress = 0;
-    if (renderer) {
-      return;
+    pthread_mutex_lock(&render_mut);
+    if (rendering) {
+      pthread_mutex_unlock(&render_mut);
+      return; // the render in progress keeps its settings & progress
     }
-    pthread_create(&renderer, nullptr, RenderMasterThread, this);
+    rendering = true;
+    progress = 0;
+    pthread_mutex_unlock(&render_mut);
+    worker_count = n_threads;
+    cancelled = false;
+    pool.Reserve(worker_count);
+    pool.Post([this] {
+      RenderImpl();
+      pthread_mutex_lock(&render_mut);
+      rendering = false;
+      progress = 1;
+      pthread_mutex_unlock(&render_mut);
+    });
   }
 
   float GetRenderProgress() override { return progress; }
 
-  void CancelRender() override {
-    for (auto& worker : workers) {
-      pthread_cancel(worker);
-    }
-  }
+  void CancelRender() override { cancelled = true; }
+
+  // Workers are reused across renders. Declared last so that it's destroyed
+  // first - the destructor waits for any render that is still in progress.
+  ThreadPool pool;
 };
 
 AnsiArt *AnsiArt::New() { return new AnsiArtImpl(); }
@@ -1,26 +1,144 @@
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <span>
 #include <string>
 
 namespace maf {
 
+// Glyphs of a monospace font, rasterized & prepared for matching.
+//
+// Atlases are immutable, so a single atlas can be shared by any number of
+// AnsiArt instances, including ones that render concurrently on different
+// threads.
+class FontAtlas {
+public:
+  // Rasterizes a TrueType font at the given size. Returns nullptr and sets
+  // `error` on failure.
+  //
+  // When `cache_dir` is set, rasterized atlases are stored there and later
+  // loads of the same font map the stored atlas into memory instead of
+  // rasterizing it again.
+  //
+  // When `characters` (UTF-8) is set, only their glyphs are rasterized. Such
+  // atlases keep a copy of the font, so that `AddCharacters` can rasterize
+  // more glyphs later. Fails if the font has none of them.
+  static std::shared_ptr<const FontAtlas>
+  LoadTTF(const uint8_t *data, size_t size, std::string &error,
+          const std::string &cache_dir = "", int font_size_pt = 15,
+          const std::string &characters = "");
+
+  // Uses an atlas serialized with `Bytes` (e.g. a header generated by
+  // `atlas_gen`) without copying it. `data` must be aligned to 64 bytes and
+  // must outlive the atlas. Returns nullptr and sets `error` if the data is
+  // not a valid atlas for this build.
+  static std::shared_ptr<const FontAtlas>
+  LoadAtlas(const uint8_t *data, size_t size, std::string &error);
+
+  virtual ~FontAtlas(){};
+  virtual std::string GlyphsUTF8() const = 0;
+  // Number of bytes taken by the atlas.
+  virtual size_t MemoryUsage() const = 0;
+  // Serialized form of the atlas, accepted by `LoadAtlas`.
+  virtual std::span<const uint8_t> Bytes() const = 0;
+  // Returns an atlas that also has the glyphs of `characters`. Only the
+  // missing glyphs are rasterized - the font stays loaded. Atlases that
+  // weren't loaded with a character list already have all of the glyphs and
+  // return themselves. Returns nullptr and sets `error` on failure, including
+  // when the font has none of the characters that weren't requested before.
+  virtual std::shared_ptr<const FontAtlas>
+  AddCharacters(const std::string &characters, std::string &error) const = 0;
+};
+
+// Layouts of the pixels passed to AnsiArt::LoadImage & LoadImageView. All of
+// them use 8 bits per channel.
+enum class PixelFormat {
+  kRGBA,
+  kBGRA,
+  kRGB,
+  kGray,
+  kPremultipliedRGBA,
+};
+
+// Ways in which AnsiArt::Render finds the best glyph for every cell.
+enum class GlyphSearch {
+  // Evaluates every glyph in full.
+  kExhaustive,
+  // Abandons every glyph as soon as the rows evaluated so far show that it
+  // can't beat the best glyph found for the cell. The glyphs of the
+  // neighbouring cells and the frequent winners are tried first. The bounds
+  // keep a margin for rounding errors, so the results match kExhaustive in
+  // practice, but that isn't guaranteed.
+  kBounded,
+  // Evaluates only the `search_candidates` glyphs whose shapes are closest to
+  // the cell (and the uniform glyphs, like space). Faster, but it can miss the
+  // best glyph.
+  kApproximate,
+  // Splits the samples of every cell into two color clusters and picks the
+  // glyph whose thresholded (1-bit) bitmap differs from the cluster mask in
+  // the fewest samples. The colors are fitted exactly for every glyph tied at
+  // that distance, and the one that fits best wins.
+  // The fastest search, but it ignores anti-aliasing & partial coverage.
+  kBinary,
+};
+
 class AnsiArt {
 public:
   static AnsiArt *New();
   
   virtual ~AnsiArt(){};
   virtual std::string LoadTTF(const uint8_t *data, size_t size) = 0;
-  virtual void LoadImage(int width, int height, const uint8_t *rgba_bytes) = 0;
+  // Uses an already loaded font. The atlas is shared, not copied.
+  virtual void SetFontAtlas(std::shared_ptr<const FontAtlas> atlas) = 0;
+  virtual void LoadImage(int width, int height, const uint8_t *bytes,
+                         PixelFormat format = PixelFormat::kRGBA) = 0;
+  // Like LoadImage, but uses the pixels in place instead of copying them.
+  // Rows of `width` pixels start `stride` bytes apart. The buffer must stay
+  // valid and unchanged until the next LoadImage / LoadImageView call or until
+  // this object is destroyed.
+  virtual void LoadImageView(int width, int height, const uint8_t *bytes,
+                             size_t stride,
+                             PixelFormat format = PixelFormat::kRGBA) = 0;
   virtual void Render() = 0;
 
   virtual void StartRender(int n_threads) = 0;
   virtual float GetRenderProgress() = 0;
   virtual void CancelRender() = 0;
 
+  // Number of bytes taken by the glyph atlas of the loaded font.
+  virtual size_t GetAtlasMemoryUsage() = 0;
+
   int width = 80;
   std::string forbidden_characters = "";
+  // When set, only these characters are used. LoadTTF then rasterizes just
+  // their glyphs, and Render rasterizes the glyphs of characters that are
+  // added later. If the font has none of the allowed characters that aren't
+  // forbidden, Render produces empty results.
+  std::string allowed_characters = "";
+  // Directory where LoadTTF caches rasterized fonts. Caching is disabled when
+  // empty.
+  std::string font_cache_dir = "";
+  // Size at which LoadTTF rasterizes the font. Determines the glyph bitmaps
+  // used for `result_rgba_bytes`.
+  int font_size_pt = 15;
+  // Number of samples per character cell at which the image is compared with
+  // the glyphs. 0 means the size of the glyph bitmaps. Lower resolutions
+  // (e.g. 4×8) render faster at the cost of fine glyph details.
+  int sample_width = 0;
+  int sample_height = 0;
+  GlyphSearch glyph_search = GlyphSearch::kExhaustive;
+  // Number of glyphs evaluated per cell by GlyphSearch::kApproximate. Values
+  // below 1 count as 1.
+  int search_candidates = 32;
+
+  // When set, Render renders the rows top to bottom and passes each row of
+  // `result_raw` (with its trailing newline) to this function as soon as it
+  // and all of the rows above it are complete. Calls are made one at a time,
+  // from the rendering threads.
+  std::function<void(const std::string &row)> on_row;
 
-  std::string glyphs_utf8;       // populated by LoadTTF
+  std::string glyphs_utf8;       // populated by LoadTTF & SetFontAtlas
   std::string result_c;          // populated by Render
   std::string result_bash;       // populated by Render
   std::string result_raw;        // populated by Render
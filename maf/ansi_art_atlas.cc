@@ -0,0 +1,241 @@
+#include "maf/ansi_art_atlas.hh"
+
+#include <sys/mman.h>
+
+#include <unordered_map>
+
+#include "maf/ansi_art_kernels.hh"
+#include "maf/unicode.hh"
+
+namespace maf {
+
+uint64_t AtlasKey(const uint8_t *data, size_t size, int font_size_pt,
+                  const std::u32string &characters) {
+  // Every 64-bit word is xor-ed into the state, which then goes through the
+  // finalizer of MurmurHash3. Unlike a plain multiplication (FNV), it spreads
+  // each bit both up & down, so differences can't cancel out in the top bit.
+  // Hashing a whole font takes well under a millisecond, which is what makes
+  // cache hits cheap.
+  uint64_t hash = 0xcbf29ce484222325;
+  auto mix = [&](uint64_t word) {
+    hash ^= word;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+  };
+  mix(kAtlasVersion);
+  mix(font_size_pt);
+  mix(size);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    mix(word);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, size - i);
+  mix(tail);
+  for (char32_t c : characters) {
+    mix(c);
+  }
+  return hash;
+}
+
+std::u32string SortedCharacters(const std::string &utf8) {
+  std::u32string characters = UTF8ToUnicode(utf8);
+  std::sort(characters.begin(), characters.end());
+  characters.erase(std::unique(characters.begin(), characters.end()),
+                   characters.end());
+  return characters;
+}
+
+static size_t AlignUp(size_t offset) {
+  constexpr size_t kAlignment = AlignedArray<uint8_t>::kAlignment;
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+FontAtlasImpl::~FontAtlasImpl() {
+  if (mapping) {
+    munmap(mapping, mapping_size);
+  }
+}
+
+// Fills the `shapes` & `complements` sections (see `FontAtlasImpl`) of
+// `n_glyphs` bitmaps of `n` pixels, `stride` bytes apart.
+static void FindDuplicates(const uint8_t *bitmaps, int n_glyphs, int n,
+                           int stride, int32_t *shapes, int32_t *complements) {
+  // FNV-1a of a bitmap, or of its complement when `flip` is 255.
+  auto hash = [&](const uint8_t *pixels, uint8_t flip) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < n; ++i) {
+      hash = (hash ^ uint8_t(pixels[i] ^ flip)) * 0x100000001b3;
+    }
+    return hash;
+  };
+  // Returns the glyph with the given bitmap (or its complement) among the
+  // ones indexed so far, or -1.
+  std::unordered_multimap<uint64_t, int> by_hash;
+  auto find = [&](const uint8_t *pixels, uint8_t flip) {
+    auto [begin, end] = by_hash.equal_range(hash(pixels, flip));
+    for (auto it = begin; it != end; ++it) {
+      const uint8_t *other = bitmaps + (size_t)it->second * stride;
+      int i = 0;
+      while (i < n && other[i] == uint8_t(pixels[i] ^ flip)) {
+        ++i;
+      }
+      if (i == n) {
+        return it->second;
+      }
+    }
+    return -1;
+  };
+  for (int g = 0; g < n_glyphs; ++g) {
+    const uint8_t *pixels = bitmaps + (size_t)g * stride;
+    shapes[g] = find(pixels, 0);
+    if (shapes[g] < 0) {
+      shapes[g] = g;
+      by_hash.insert({hash(pixels, 0), g});
+    }
+  }
+  for (int g = 0; g < n_glyphs; ++g) {
+    complements[g] = find(bitmaps + (size_t)g * stride, 255);
+  }
+}
+
+std::shared_ptr<FontAtlasImpl>
+FontAtlasImpl::Build(uint64_t key, int glyph_width, int glyph_height,
+                     const std::vector<Glyph> &glyphs,
+                     const std::vector<uint8_t> &bitmaps) {
+  AtlasHeader header = {};
+  memcpy(header.magic, kAtlasMagic, sizeof(header.magic));
+  header.version = kAtlasVersion;
+  header.byte_order = kAtlasByteOrder;
+  header.key = key;
+  header.glyph_width = glyph_width;
+  header.glyph_height = glyph_height;
+  header.stride = KernelStride(glyph_width * glyph_height);
+  header.n_glyphs = glyphs.size();
+  size_t n_glyphs = glyphs.size(), stride = header.stride;
+  header.glyphs_offset = AlignUp(sizeof(AtlasHeader));
+  header.bitmaps_offset =
+      AlignUp(header.glyphs_offset + n_glyphs * sizeof(Glyph));
+  header.coverage_offset = AlignUp(header.bitmaps_offset + n_glyphs * stride);
+  header.shapes_offset =
+      AlignUp(header.coverage_offset + n_glyphs * stride * sizeof(float));
+  header.complements_offset =
+      AlignUp(header.shapes_offset + n_glyphs * sizeof(int32_t));
+  header.size =
+      AlignUp(header.complements_offset + n_glyphs * sizeof(int32_t));
+
+  AlignedArray<uint8_t> storage;
+  storage.Resize(header.size);
+  uint8_t *blob = storage.data;
+  memcpy(blob, &header, sizeof(header));
+  if (n_glyphs) {
+    memcpy(blob + header.glyphs_offset, glyphs.data(),
+           n_glyphs * sizeof(Glyph));
+  }
+  std::copy(bitmaps.begin(), bitmaps.end(), blob + header.bitmaps_offset);
+  float *coverage = (float *)(blob + header.coverage_offset);
+  for (size_t i = 0; i < n_glyphs * stride; ++i) {
+    coverage[i] = bitmaps[i] / 255.f;
+  }
+  FindDuplicates(blob + header.bitmaps_offset, n_glyphs,
+                 glyph_width * glyph_height, stride,
+                 (int32_t *)(blob + header.shapes_offset),
+                 (int32_t *)(blob + header.complements_offset));
+
+  std::string error;
+  auto atlas = Wrap(blob, header.size, error);
+  atlas->storage = std::move(storage);
+  return atlas;
+}
+
+std::shared_ptr<FontAtlasImpl>
+FontAtlasImpl::Wrap(const uint8_t *blob, size_t size, std::string &error) {
+  AtlasHeader header;
+  if (size < sizeof(header)) {
+    error = "Atlas is truncated";
+    return nullptr;
+  }
+  memcpy(&header, blob, sizeof(header));
+  if (memcmp(header.magic, kAtlasMagic, sizeof(header.magic))) {
+    error = "Not a font atlas";
+    return nullptr;
+  }
+  if (header.version != kAtlasVersion ||
+      header.byte_order != kAtlasByteOrder) {
+    error = "Incompatible font atlas";
+    return nullptr;
+  }
+  uint64_t n_glyphs = header.n_glyphs, stride = header.stride;
+  uint64_t alignment = AlignedArray<uint8_t>::kAlignment;
+  if (header.size != size || header.glyph_width <= 0 ||
+      header.glyph_height <= 0 || header.n_glyphs < 0 ||
+      header.stride !=
+          KernelStride(header.glyph_width * header.glyph_height) ||
+      (uintptr_t)blob % alignment || header.glyphs_offset % alignment ||
+      header.bitmaps_offset % alignment || header.coverage_offset % alignment ||
+      header.shapes_offset % alignment ||
+      header.complements_offset % alignment ||
+      header.glyphs_offset < sizeof(header) ||
+      header.bitmaps_offset < header.glyphs_offset + n_glyphs * sizeof(Glyph) ||
+      header.coverage_offset < header.bitmaps_offset + n_glyphs * stride ||
+      header.shapes_offset <
+          header.coverage_offset + n_glyphs * stride * sizeof(float) ||
+      header.complements_offset <
+          header.shapes_offset + n_glyphs * sizeof(int32_t) ||
+      size < header.complements_offset + n_glyphs * sizeof(int32_t)) {
+    error = "Corrupted font atlas";
+    return nullptr;
+  }
+  // The renderer indexes its tables with these, so they must be in range.
+  const int32_t *shapes = (const int32_t *)(blob + header.shapes_offset);
+  const int32_t *complements =
+      (const int32_t *)(blob + header.complements_offset);
+  for (int32_t g = 0; g < header.n_glyphs; ++g) {
+    if (shapes[g] < 0 || shapes[g] > g || complements[g] < -1 ||
+        complements[g] >= header.n_glyphs) {
+      error = "Corrupted font atlas";
+      return nullptr;
+    }
+  }
+  auto atlas = std::make_shared<FontAtlasImpl>();
+  atlas->glyph_width = header.glyph_width;
+  atlas->glyph_height = header.glyph_height;
+  atlas->aspect = float(atlas->glyph_height) / atlas->glyph_width;
+  atlas->stride = header.stride;
+  atlas->glyphs = std::span<const Glyph>(
+      (const Glyph *)(blob + header.glyphs_offset), n_glyphs);
+  atlas->bitmaps = blob + header.bitmaps_offset;
+  atlas->coverage = (const float *)(blob + header.coverage_offset);
+  atlas->shapes = shapes;
+  atlas->complements = complements;
+  atlas->blob = blob;
+  atlas->blob_size = size;
+  return atlas;
+}
+
+std::string FontAtlasImpl::GlyphsUTF8() const {
+  std::string utf8;
+  for (auto &glyph : glyphs) {
+    utf8 += glyph.utf8;
+  }
+  return utf8;
+}
+
+size_t FontAtlasImpl::MemoryUsage() const { return blob_size; }
+
+std::span<const uint8_t> FontAtlasImpl::Bytes() const {
+  return std::span<const uint8_t>(blob, blob_size);
+}
+
+std::shared_ptr<const FontAtlas>
+FontAtlas::LoadAtlas(const uint8_t *data, size_t size, std::string &error) {
+  error = "";
+  return FontAtlasImpl::Wrap(data, size, error);
+}
+
+} // namespace maf
@@ -0,0 +1,167 @@
+#pragma once
+
+// Internals of FontAtlas, shared by the rasterizer & the renderer.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "maf/ansi_art.hh"
+
+namespace maf {
+
+// Zero-initialized heap array aligned to a cache line, suitable for the
+// widest SIMD loads.
+template <typename T> struct AlignedArray {
+  static constexpr size_t kAlignment = 64;
+  T *data = nullptr;
+  size_t size = 0;
+
+  AlignedArray() = default;
+  AlignedArray(const AlignedArray &) = delete;
+  AlignedArray &operator=(const AlignedArray &) = delete;
+  AlignedArray(AlignedArray &&other) { *this = std::move(other); }
+  AlignedArray &operator=(AlignedArray &&other) {
+    std::swap(data, other.data);
+    std::swap(size, other.size);
+    return *this;
+  }
+  ~AlignedArray() { free(data); }
+
+  void Resize(size_t new_size) {
+    free(data);
+    size = new_size;
+    size_t bytes =
+        (size * sizeof(T) + kAlignment - 1) / kAlignment * kAlignment;
+    data = (T *)aligned_alloc(kAlignment, std::max(bytes, kAlignment));
+    memset(data, 0, bytes);
+  }
+  T &operator[](size_t i) { return data[i]; }
+  const T &operator[](size_t i) const { return data[i]; }
+};
+
+// Glyph record. Trivially copyable so that atlases can store them as-is.
+struct Glyph {
+  uint32_t unicode;
+  char utf8[8]; // null-terminated
+  // Coverage moments used by the closed-form color solver. With `w` being
+  // the coverage of a glyph pixel (0..1): `coverage_sum` = Σw and
+  // `coverage_sq_sum` = Σw².
+  float coverage_sum;
+  float coverage_sq_sum;
+};
+
+// Atlases are kept in a single blob that can be written to disk and mapped
+// back into memory as-is. The blob starts with this header and is followed by
+// five sections, each aligned to `AlignedArray::kAlignment`:
+// - glyph records (`Glyph[n_glyphs]`)
+// - glyph bitmaps (`uint8_t[n_glyphs][stride]`, zero-padded)
+// - glyph matrix (`float[n_glyphs][stride]`, bitmaps converted to 0..1)
+// - identical glyphs (`int32_t[n_glyphs]`, see `FontAtlasImpl::shapes`)
+// - complementary glyphs (`int32_t[n_glyphs]`, see
+//   `FontAtlasImpl::complements`)
+// Numbers are stored in the native byte order - `byte_order` allows readers
+// to reject blobs from other machines.
+struct AtlasHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t key; // see `AtlasKey`
+  uint64_t size;
+  int32_t glyph_width;
+  int32_t glyph_height;
+  int32_t stride;
+  int32_t n_glyphs;
+  uint64_t glyphs_offset;
+  uint64_t bitmaps_offset;
+  uint64_t coverage_offset;
+  uint64_t shapes_offset;
+  uint64_t complements_offset;
+};
+
+constexpr char kAtlasMagic[8] = "mafatls";
+// Must be bumped whenever the blob layout or the rasterization changes.
+constexpr uint32_t kAtlasVersion = 3;
+constexpr uint32_t kAtlasByteOrder = 0x01020304;
+
+// Identifies the atlas produced from the given font file. Covers the font,
+// the format version & the rasterization parameters. `characters` is empty
+// for atlases with all glyphs of the font.
+uint64_t AtlasKey(const uint8_t *data, size_t size, int font_size_pt,
+                  const std::u32string &characters);
+
+// Unique code points of a UTF-8 string, in ascending order.
+std::u32string SortedCharacters(const std::string &utf8);
+
+// Open font of a lazily loaded atlas. Defined with the rasterizer.
+struct FontSource;
+
+class FontAtlasImpl : public FontAtlas,
+                      public std::enable_shared_from_this<FontAtlasImpl> {
+public:
+  int glyph_height;
+  int glyph_width;
+  float aspect;
+  int stride; // glyph_width * glyph_height rounded up for the kernels
+  std::span<const Glyph> glyphs;
+  // Atlas arena - the bitmaps of all glyphs, `stride` bytes apart.
+  const uint8_t *bitmaps;
+  // Glyph matrix - row `i` holds the bitmap of `glyphs[i]` converted to 0..1
+  // floats and zero-padded to `stride`.
+  const float *coverage;
+  // Glyphs that look the same, found when the atlas is built. `shapes[i]` is
+  // the lowest index of a glyph whose bitmap is identical to the bitmap of
+  // `glyphs[i]`, and `complements[i]` is the lowest index of a glyph whose
+  // bitmap is its complement (255 - pixel), or -1.
+  const int32_t *shapes;
+  const int32_t *complements;
+  // The whole atlas (see `AtlasHeader`).
+  const uint8_t *blob;
+  size_t blob_size;
+  // Lazily loaded atlases only have glyphs for the `requested` characters and
+  // keep the font open to rasterize more of them. Both are empty for atlases
+  // with all glyphs of the font.
+  // `AddCharacters` also adds the characters that the font lacks, so that it
+  // doesn't look for them again - guarded by the mutex of `source`.
+  std::shared_ptr<FontSource> source;
+  mutable std::u32string requested;
+
+  ~FontAtlasImpl();
+
+  // Packs rasterized glyphs into a new blob. `bitmaps` holds `stride` bytes
+  // per glyph.
+  static std::shared_ptr<FontAtlasImpl>
+  Build(uint64_t key, int glyph_width, int glyph_height,
+        const std::vector<Glyph> &glyphs, const std::vector<uint8_t> &bitmaps);
+
+  // Uses an existing blob without copying it. The blob must outlive the
+  // atlas. Returns nullptr and sets `error` if the blob is malformed.
+  static std::shared_ptr<FontAtlasImpl> Wrap(const uint8_t *blob, size_t size,
+                                             std::string &error);
+
+  int Index(const Glyph &glyph) const { return &glyph - glyphs.data(); }
+
+  const uint8_t *Pixels(const Glyph &glyph) const {
+    return bitmaps + (size_t)Index(glyph) * stride;
+  }
+
+  std::string GlyphsUTF8() const override;
+  size_t MemoryUsage() const override;
+  std::span<const uint8_t> Bytes() const override;
+  std::shared_ptr<const FontAtlas>
+  AddCharacters(const std::string &characters,
+                std::string &error) const override;
+
+  // Owner of the blob, if any.
+  AlignedArray<uint8_t> storage; // blob created by `Build`
+  void *mapping = nullptr;       // blob mapped from the atlas cache
+  size_t mapping_size = 0;
+};
+
+} // namespace maf
@@ -58,6 +58,11 @@ emscripten::val EmGetRgbaBytes(AnsiArt &art) {
 
 EMSCRIPTEN_BINDINGS(unicode_ansi_art) {
   function("GetDefaultTTF", &GetDefaultTTF);
+  enum_<GlyphSearch>("GlyphSearch")
+      .value("kExhaustive", GlyphSearch::kExhaustive)
+      .value("kBounded", GlyphSearch::kBounded)
+      .value("kApproximate", GlyphSearch::kApproximate)
+      .value("kBinary", GlyphSearch::kBinary);
   class_<AnsiArt>("AnsiArt")
       .constructor(&AnsiArt::New, allow_raw_pointers())
       .function("LoadTTF", &EmLoadTTF)
@@ -67,8 +72,15 @@ EMSCRIPTEN_BINDINGS(unicode_ansi_art) {
       .function("StartRender", &AnsiArt::StartRender)
       .function("GetRenderProgress", &AnsiArt::GetRenderProgress)
       .function("CancelRender", &AnsiArt::CancelRender)
+      .function("GetAtlasMemoryUsage", &AnsiArt::GetAtlasMemoryUsage)
       .property("width", &AnsiArt::width)
       .property("forbidden_characters", &AnsiArt::forbidden_characters)
+      .property("allowed_characters", &AnsiArt::allowed_characters)
+      .property("font_size_pt", &AnsiArt::font_size_pt)
+      .property("sample_width", &AnsiArt::sample_width)
+      .property("sample_height", &AnsiArt::sample_height)
+      .property("glyph_search", &AnsiArt::glyph_search)
+      .property("search_candidates", &AnsiArt::search_candidates)
       .property("glyphs_utf8", &AnsiArt::glyphs_utf8)
       .property("result_c", &AnsiArt::result_c)
       .property("result_bash", &AnsiArt::result_bash)
@@ -0,0 +1,269 @@
+#include "maf/ansi_art_index.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace maf {
+
+// Leaves hold up to this many glyphs.
+static constexpr int kLeafSize = 8;
+
+// Mean-centres & normalizes `n` values. Returns false if they're (nearly)
+// all the same.
+static bool Normalize(const float *values, int n, float sign, float *out) {
+  double mean = 0;
+  for (int i = 0; i < n; ++i) {
+    mean += values[i];
+  }
+  mean /= n;
+  double sq_sum = 0;
+  for (int i = 0; i < n; ++i) {
+    out[i] = sign * (values[i] - mean);
+    sq_sum += out[i] * out[i];
+  }
+  if (sq_sum < 1e-6) {
+    return false;
+  }
+  float scale = 1 / sqrt(sq_sum);
+  for (int i = 0; i < n; ++i) {
+    out[i] *= scale;
+  }
+  return true;
+}
+
+void GlyphIndex::Build(const float *coverage, int n_glyphs, int n_samples,
+                       int stride) {
+  this->n_samples = n_samples;
+  uniform.clear();
+  points.clear();
+  nodes.clear();
+
+  std::vector<float> patterns;
+  std::vector<int> shaped;
+  std::vector<float> pattern(n_samples);
+  for (int g = 0; g < n_glyphs; ++g) {
+    if (Normalize(coverage + g * stride, n_samples, 1, pattern.data())) {
+      patterns.insert(patterns.end(), pattern.begin(), pattern.end());
+      shaped.push_back(g);
+    } else {
+      uniform.push_back(g);
+    }
+  }
+  int n_shaped = shaped.size();
+
+  mean.assign(n_samples, 0);
+  for (int g = 0; g < n_shaped; ++g) {
+    for (int i = 0; i < n_samples; ++i) {
+      mean[i] += patterns[g * n_samples + i];
+    }
+  }
+  for (float &m : mean) {
+    m /= std::max(n_shaped, 1);
+  }
+  for (int g = 0; g < n_shaped; ++g) {
+    for (int i = 0; i < n_samples; ++i) {
+      patterns[g * n_samples + i] -= mean[i];
+    }
+  }
+
+  // Covariance matrix of the patterns. Its leading eigenvectors are found by
+  // subspace iteration, which is plenty for a few components of a matrix
+  // this small.
+  std::vector<double> covariance(n_samples * n_samples, 0.);
+  for (int g = 0; g < n_shaped; ++g) {
+    const float *x = &patterns[g * n_samples];
+    for (int i = 0; i < n_samples; ++i) {
+      if (x[i] == 0) {
+        continue;
+      }
+      for (int j = i; j < n_samples; ++j) {
+        covariance[i * n_samples + j] += x[i] * x[j];
+      }
+    }
+  }
+  for (int i = 0; i < n_samples; ++i) {
+    for (int j = 0; j < i; ++j) {
+      covariance[i * n_samples + j] = covariance[j * n_samples + i];
+    }
+  }
+  int dims = std::min(kDims, n_samples);
+  std::vector<double> basis(kDims * n_samples, 0.), next(basis.size());
+  for (int d = 0; d < dims; ++d) {
+    // Deterministic start that isn't orthogonal to any of the axes.
+    for (int i = 0; i < n_samples; ++i) {
+      basis[d * n_samples + i] = ((i * (d + 3) + d) % 7) - 3 + 0.5;
+    }
+  }
+  for (int iteration = 0; iteration < 50; ++iteration) {
+    std::fill(next.begin(), next.end(), 0.);
+    for (int d = 0; d < dims; ++d) {
+      const double *v = &basis[d * n_samples];
+      double *out = &next[d * n_samples];
+      for (int i = 0; i < n_samples; ++i) {
+        const double *row = &covariance[i * n_samples];
+        double dot = 0;
+        for (int j = 0; j < n_samples; ++j) {
+          dot += row[j] * v[j];
+        }
+        out[i] = dot;
+      }
+    }
+    // Gram-Schmidt
+    for (int d = 0; d < dims; ++d) {
+      double *v = &next[d * n_samples];
+      for (int e = 0; e < d; ++e) {
+        const double *u = &next[e * n_samples];
+        double dot = 0;
+        for (int i = 0; i < n_samples; ++i) {
+          dot += u[i] * v[i];
+        }
+        for (int i = 0; i < n_samples; ++i) {
+          v[i] -= dot * u[i];
+        }
+      }
+      double norm = 0;
+      for (int i = 0; i < n_samples; ++i) {
+        norm += v[i] * v[i];
+      }
+      norm = sqrt(norm);
+      for (int i = 0; i < n_samples; ++i) {
+        v[i] = norm > 1e-12 ? v[i] / norm : 0;
+      }
+    }
+    basis.swap(next);
+  }
+  components.assign(basis.begin(), basis.end());
+
+  points.resize(n_shaped);
+  for (int g = 0; g < n_shaped; ++g) {
+    Point &point = points[g];
+    point.glyph = shaped[g];
+    for (int d = 0; d < kDims; ++d) {
+      double dot = 0;
+      for (int i = 0; i < n_samples; ++i) {
+        dot += components[d * n_samples + i] * patterns[g * n_samples + i];
+      }
+      point.coords[d] = dot;
+    }
+  }
+  if (n_shaped > 0) {
+    BuildNode(0, n_shaped);
+  }
+}
+
+int GlyphIndex::BuildNode(int begin, int end) {
+  int index = nodes.size();
+  nodes.push_back({-1, 0, -1, -1, begin, end});
+  if (end - begin <= kLeafSize) {
+    return index;
+  }
+  // Split the widest dimension at the median.
+  int dim = 0;
+  float widest = -1;
+  for (int d = 0; d < kDims; ++d) {
+    auto [lo, hi] = std::minmax_element(
+        points.begin() + begin, points.begin() + end,
+        [&](const Point &a, const Point &b) {
+          return a.coords[d] < b.coords[d];
+        });
+    if (hi->coords[d] - lo->coords[d] > widest) {
+      widest = hi->coords[d] - lo->coords[d];
+      dim = d;
+    }
+  }
+  int mid = (begin + end) / 2;
+  std::nth_element(points.begin() + begin, points.begin() + mid,
+                   points.begin() + end,
+                   [&](const Point &a, const Point &b) {
+                     return a.coords[dim] < b.coords[dim];
+                   });
+  float split = points[mid].coords[dim];
+  int left = BuildNode(begin, mid);
+  int right = BuildNode(mid, end);
+  nodes[index] = {dim, split, left, right, begin, end};
+  return index;
+}
+
+bool GlyphIndex::Project(const float *pattern, float sign,
+                         float out[kDims]) const {
+  std::vector<float> normalized(n_samples);
+  bool shaped = Normalize(pattern, n_samples, sign, normalized.data());
+  for (int d = 0; d < kDims; ++d) {
+    const float *component = &components[d * n_samples];
+    double dot = 0;
+    for (int i = 0; i < n_samples; ++i) {
+      float x = shaped ? normalized[i] : 0;
+      dot += component[i] * (x - mean[i]);
+    }
+    out[d] = dot;
+  }
+  return shaped;
+}
+
+void GlyphIndex::Query(const float *pattern, int k, std::vector<int> &out)
+    const {
+  out.clear();
+  k = std::min(k, (int)points.size());
+  if (k > 0) {
+    // Max-heap of the `k` closest glyphs found so far (squared distance,
+    // index in `points`). Until it fills up, `worst` stays infinite.
+    std::vector<std::pair<float, int>> closest;
+    closest.reserve(k);
+    float worst = INFINITY;
+    float query[kDims];
+    // `box_dist` is the squared distance from the query to the cell of the
+    // node, built up from its per-dimension offsets (`offsets`). Nodes that
+    // are farther away than the `k`th closest glyph are skipped.
+    float offsets[kDims];
+    auto search = [&](auto &self, int index, float box_dist) -> void {
+      const Node &node = nodes[index];
+      if (node.dim < 0) {
+        for (int p = node.begin; p < node.end; ++p) {
+          float dist = 0;
+          for (int d = 0; d < kDims; ++d) {
+            float diff = points[p].coords[d] - query[d];
+            dist += diff * diff;
+          }
+          if (dist >= worst) {
+            continue;
+          }
+          if ((int)closest.size() == k) {
+            std::pop_heap(closest.begin(), closest.end());
+            closest.pop_back();
+          }
+          closest.push_back({dist, p});
+          std::push_heap(closest.begin(), closest.end());
+          if ((int)closest.size() == k) {
+            worst = closest.front().first;
+          }
+        }
+        return;
+      }
+      float diff = query[node.dim] - node.split;
+      self(self, diff < 0 ? node.left : node.right, box_dist);
+      float old_offset = offsets[node.dim];
+      float far_dist = box_dist - old_offset * old_offset + diff * diff;
+      if (far_dist < worst) {
+        offsets[node.dim] = diff;
+        self(self, diff < 0 ? node.right : node.left, far_dist);
+        offsets[node.dim] = old_offset;
+      }
+    };
+    std::fill_n(offsets, kDims, 0.f);
+    bool shaped = Project(pattern, 1, query);
+    search(search, 0, 0);
+    if (shaped) {
+      Project(pattern, -1, query);
+      search(search, 0, 0);
+    }
+    for (auto &[dist, p] : closest) {
+      out.push_back(points[p].glyph);
+    }
+  }
+  out.insert(out.end(), uniform.begin(), uniform.end());
+  std::sort(out.begin(), out.end());
+  out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+} // namespace maf
@@ -0,0 +1,58 @@
+#pragma once
+
+// Approximate nearest-neighbour index of glyph shapes, used by
+// GlyphSearch::kApproximate.
+
+#include <vector>
+
+namespace maf {
+
+// The error of the best fg & bg for a glyph depends mostly on how well the
+// glyph's coverage correlates with the cell. Coverage patterns are therefore
+// mean-centred & normalized, which leaves only the shape of a glyph (not its
+// ink level). The patterns are projected onto their first `kDims` principal
+// components and stored in a k-d tree.
+//
+// Uniform glyphs (e.g. space & full block) have no shape. They fit every
+// cell equally well, so they're returned by every query.
+class GlyphIndex {
+public:
+  static constexpr int kDims = 8;
+
+  // Indexes `n_glyphs` coverage patterns of `n_samples` values. Pattern `g`
+  // starts at `coverage[g * stride]`.
+  void Build(const float *coverage, int n_glyphs, int n_samples, int stride);
+
+  // Stores in `out` the `k` glyphs whose shapes are closest to `pattern`
+  // (`n_samples` values) or to its negation - fg & bg can be swapped - and
+  // all of the uniform glyphs.
+  void Query(const float *pattern, int k, std::vector<int> &out) const;
+
+private:
+  struct Node {
+    int dim;     // split dimension, -1 for leaves
+    float split; // points with `point[dim] < split` are on the left
+    int left, right;
+    int begin, end; // range of `points` in leaves
+  };
+
+  int BuildNode(int begin, int end);
+  // Projects the normalized form of `pattern` (negated if `sign` is -1).
+  // Returns false for uniform patterns.
+  bool Project(const float *pattern, float sign, float out[kDims]) const;
+
+  int n_samples = 0;
+  std::vector<float> mean;       // mean of the normalized patterns
+  std::vector<float> components; // kDims rows of `n_samples` values
+  std::vector<int> uniform;      // glyphs without a shape
+
+  // Projected glyphs, reordered by the tree.
+  struct Point {
+    float coords[kDims];
+    int glyph;
+  };
+  std::vector<Point> points;
+  std::vector<Node> nodes; // root first
+};
+
+} // namespace maf
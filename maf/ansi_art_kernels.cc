@@ -0,0 +1,474 @@
+// The kernels must round exactly like the scalar version - keep the compiler
+// from fusing multiplications & additions into FMAs.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "maf/ansi_art_kernels.hh"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MAF_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace maf {
+
+// Sums the lanes in a fixed order: 16 → 8 → 4 → 2 → 1.
+static float ReduceLanes(float lanes[kKernelLanes]) {
+  for (int width = kKernelLanes / 2; width > 0; width /= 2) {
+    for (int j = 0; j < width; ++j) {
+      lanes[j] = lanes[j] + lanes[j + width];
+    }
+  }
+  return lanes[0];
+}
+
+static void ScalarWeightedSum(const float *coverage, const float *planes,
+                              int stride, float out[4]) {
+  for (int c = 0; c < 4; ++c) {
+    const float *plane = planes + c * stride;
+    float lanes[kKernelLanes] = {};
+    for (int i = 0; i < stride; i += kKernelLanes) {
+      for (int j = 0; j < kKernelLanes; ++j) {
+        lanes[j] = lanes[j] + coverage[i + j] * plane[i + j];
+      }
+    }
+    out[c] = ReduceLanes(lanes);
+  }
+}
+
+// Each glyph row is reused for all of the cells in the block while it's still
+// in L1. The caller is responsible for keeping the blocks small enough.
+template <void (*WeightedSum)(const float *, const float *, int, float[4])>
+static void BlockWeightedSums(const float *glyphs, int n_glyphs,
+                              const float *cells, int n_cells, int stride,
+                              float *out) {
+  for (int g = 0; g < n_glyphs; ++g) {
+    const float *coverage = glyphs + g * stride;
+    for (int c = 0; c < n_cells; ++c) {
+      WeightedSum(coverage, cells + c * 4 * stride, stride,
+                  out + (c * n_glyphs + g) * 4);
+    }
+  }
+}
+
+static void ScalarAccumulateWeightedSums(const float *coverage,
+                                         const float *planes, int stride,
+                                         int begin, int end, float *lanes,
+                                         float out[4]) {
+  for (int c = 0; c < 4; ++c) {
+    const float *plane = planes + c * stride;
+    float acc[kKernelLanes];
+    std::copy_n(lanes + c * kKernelLanes, kKernelLanes, acc);
+    for (int i = begin; i < end; i += kKernelLanes) {
+      for (int j = 0; j < kKernelLanes; ++j) {
+        acc[j] = acc[j] + coverage[i + j] * plane[i + j];
+      }
+    }
+    std::copy_n(acc, kKernelLanes, lanes + c * kKernelLanes);
+    out[c] = ReduceLanes(acc);
+  }
+}
+
+const MatchingKernel kScalarKernel = {"scalar", ScalarWeightedSum,
+                                      BlockWeightedSums<ScalarWeightedSum>,
+                                      ScalarAccumulateWeightedSums};
+
+#ifdef MAF_KERNELS_X86
+
+// Horizontal sums follow the lane tree of `ReduceLanes`: each step adds the
+// upper half of the lanes to the lower half.
+
+__attribute__((target("sse4.2"))) static inline float Reduce4(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("avx2"))) static inline float Reduce8(__m256 v) {
+  return Reduce4(
+      _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx512f"))) static inline float Reduce16(__m512 v) {
+  __m256 lo = _mm512_castps512_ps256(v);
+  __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+  return Reduce8(_mm256_add_ps(lo, hi));
+}
+
+__attribute__((target("sse4.2"))) static void
+Sse42WeightedSum(const float *coverage, const float *planes, int stride,
+                 float out[4]) {
+  __m128 acc[4][4];
+  for (int c = 0; c < 4; ++c)
+    for (int k = 0; k < 4; ++k)
+      acc[c][k] = _mm_setzero_ps();
+  for (int i = 0; i < stride; i += kKernelLanes) {
+    for (int k = 0; k < 4; ++k) {
+      __m128 w = _mm_loadu_ps(coverage + i + 4 * k);
+      for (int c = 0; c < 4; ++c) {
+        __m128 x = _mm_loadu_ps(planes + c * stride + i + 4 * k);
+        acc[c][k] = _mm_add_ps(acc[c][k], _mm_mul_ps(w, x));
+      }
+    }
+  }
+  for (int c = 0; c < 4; ++c) {
+    out[c] = Reduce4(_mm_add_ps(_mm_add_ps(acc[c][0], acc[c][2]),
+                                _mm_add_ps(acc[c][1], acc[c][3])));
+  }
+}
+
+__attribute__((target("avx2"))) static void
+Avx2WeightedSum(const float *coverage, const float *planes, int stride,
+                float out[4]) {
+  __m256 acc[4][2];
+  for (int c = 0; c < 4; ++c)
+    for (int k = 0; k < 2; ++k)
+      acc[c][k] = _mm256_setzero_ps();
+  for (int i = 0; i < stride; i += kKernelLanes) {
+    for (int k = 0; k < 2; ++k) {
+      __m256 w = _mm256_loadu_ps(coverage + i + 8 * k);
+      for (int c = 0; c < 4; ++c) {
+        __m256 x = _mm256_loadu_ps(planes + c * stride + i + 8 * k);
+        acc[c][k] = _mm256_add_ps(acc[c][k], _mm256_mul_ps(w, x));
+      }
+    }
+  }
+  for (int c = 0; c < 4; ++c) {
+    out[c] = Reduce8(_mm256_add_ps(acc[c][0], acc[c][1]));
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+Avx512WeightedSum(const float *coverage, const float *planes, int stride,
+                  float out[4]) {
+  __m512 acc[4];
+  for (int c = 0; c < 4; ++c)
+    acc[c] = _mm512_setzero_ps();
+  for (int i = 0; i < stride; i += kKernelLanes) {
+    __m512 w = _mm512_loadu_ps(coverage + i);
+    for (int c = 0; c < 4; ++c) {
+      __m512 x = _mm512_loadu_ps(planes + c * stride + i);
+      acc[c] = _mm512_add_ps(acc[c], _mm512_mul_ps(w, x));
+    }
+  }
+  for (int c = 0; c < 4; ++c) {
+    out[c] = Reduce16(acc[c]);
+  }
+}
+
+// AVX-512 has enough registers to match one glyph against four cells at once,
+// loading each coverage vector only once.
+__attribute__((target("avx512f"))) static void
+Avx512BlockWeightedSums(const float *glyphs, int n_glyphs, const float *cells,
+                        int n_cells, int stride, float *out) {
+  for (int g = 0; g < n_glyphs; ++g) {
+    const float *coverage = glyphs + g * stride;
+    int c = 0;
+    for (; c + 4 <= n_cells; c += 4) {
+      __m512 acc[4][4];
+      for (int k = 0; k < 4; ++k)
+        for (int ch = 0; ch < 4; ++ch)
+          acc[k][ch] = _mm512_setzero_ps();
+      const float *planes = cells + c * 4 * stride;
+      for (int i = 0; i < stride; i += kKernelLanes) {
+        __m512 w = _mm512_loadu_ps(coverage + i);
+        for (int k = 0; k < 4; ++k) {
+          for (int ch = 0; ch < 4; ++ch) {
+            __m512 x = _mm512_loadu_ps(planes + (4 * k + ch) * stride + i);
+            acc[k][ch] = _mm512_add_ps(acc[k][ch], _mm512_mul_ps(w, x));
+          }
+        }
+      }
+      for (int k = 0; k < 4; ++k) {
+        float *o = out + ((c + k) * n_glyphs + g) * 4;
+        for (int ch = 0; ch < 4; ++ch)
+          o[ch] = Reduce16(acc[k][ch]);
+      }
+    }
+    for (; c < n_cells; ++c) {
+      Avx512WeightedSum(coverage, cells + c * 4 * stride, stride,
+                        out + (c * n_glyphs + g) * 4);
+    }
+  }
+}
+
+// The lanes of the incremental kernels are laid out like the accumulators of
+// the corresponding `weighted_sum`, so both round identically.
+
+__attribute__((target("sse4.2"))) static void
+Sse42AccumulateWeightedSums(const float *coverage, const float *planes,
+                            int stride, int begin, int end, float *lanes,
+                            float out[4]) {
+  for (int c = 0; c < 4; ++c) {
+    const float *plane = planes + c * stride;
+    float *lane = lanes + c * kKernelLanes;
+    __m128 acc[4];
+    for (int k = 0; k < 4; ++k)
+      acc[k] = _mm_loadu_ps(lane + 4 * k);
+    for (int i = begin; i < end; i += kKernelLanes) {
+      for (int k = 0; k < 4; ++k) {
+        __m128 w = _mm_loadu_ps(coverage + i + 4 * k);
+        __m128 x = _mm_loadu_ps(plane + i + 4 * k);
+        acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(w, x));
+      }
+    }
+    for (int k = 0; k < 4; ++k)
+      _mm_storeu_ps(lane + 4 * k, acc[k]);
+    out[c] = Reduce4(
+        _mm_add_ps(_mm_add_ps(acc[0], acc[2]), _mm_add_ps(acc[1], acc[3])));
+  }
+}
+
+__attribute__((target("avx2"))) static void
+Avx2AccumulateWeightedSums(const float *coverage, const float *planes,
+                           int stride, int begin, int end, float *lanes,
+                           float out[4]) {
+  for (int c = 0; c < 4; ++c) {
+    const float *plane = planes + c * stride;
+    float *lane = lanes + c * kKernelLanes;
+    __m256 acc[2];
+    for (int k = 0; k < 2; ++k)
+      acc[k] = _mm256_loadu_ps(lane + 8 * k);
+    for (int i = begin; i < end; i += kKernelLanes) {
+      for (int k = 0; k < 2; ++k) {
+        __m256 w = _mm256_loadu_ps(coverage + i + 8 * k);
+        __m256 x = _mm256_loadu_ps(plane + i + 8 * k);
+        acc[k] = _mm256_add_ps(acc[k], _mm256_mul_ps(w, x));
+      }
+    }
+    for (int k = 0; k < 2; ++k)
+      _mm256_storeu_ps(lane + 8 * k, acc[k]);
+    out[c] = Reduce8(_mm256_add_ps(acc[0], acc[1]));
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+Avx512AccumulateWeightedSums(const float *coverage, const float *planes,
+                             int stride, int begin, int end, float *lanes,
+                             float out[4]) {
+  for (int c = 0; c < 4; ++c) {
+    const float *plane = planes + c * stride;
+    float *lane = lanes + c * kKernelLanes;
+    __m512 acc = _mm512_loadu_ps(lane);
+    for (int i = begin; i < end; i += kKernelLanes) {
+      __m512 w = _mm512_loadu_ps(coverage + i);
+      __m512 x = _mm512_loadu_ps(plane + i);
+      acc = _mm512_add_ps(acc, _mm512_mul_ps(w, x));
+    }
+    _mm512_storeu_ps(lane, acc);
+    out[c] = Reduce16(acc);
+  }
+}
+
+static const MatchingKernel kSse42Kernel = {
+    "sse4.2", Sse42WeightedSum, BlockWeightedSums<Sse42WeightedSum>,
+    Sse42AccumulateWeightedSums};
+static const MatchingKernel kAvx2Kernel = {
+    "avx2", Avx2WeightedSum, BlockWeightedSums<Avx2WeightedSum>,
+    Avx2AccumulateWeightedSums};
+static const MatchingKernel kAvx512Kernel = {"avx512f", Avx512WeightedSum,
+                                             Avx512BlockWeightedSums,
+                                             Avx512AccumulateWeightedSums};
+
+#endif // MAF_KERNELS_X86
+
+int SupportedMatchingKernels(const MatchingKernel **out, int max_count) {
+  int count = 0;
+  auto add = [&](const MatchingKernel &kernel) {
+    if (count < max_count) {
+      out[count++] = &kernel;
+    }
+  };
+  add(kScalarKernel);
+#ifdef MAF_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    add(kSse42Kernel);
+  if (__builtin_cpu_supports("avx2"))
+    add(kAvx2Kernel);
+  if (__builtin_cpu_supports("avx512f"))
+    add(kAvx512Kernel);
+#endif
+  return count;
+}
+
+static inline void MaskDistancesImpl(const uint64_t *masks, int n_masks,
+                                     int n_words, const uint64_t *mask,
+                                     int *out) {
+  for (int m = 0; m < n_masks; ++m) {
+    const uint64_t *words = masks + m * n_words;
+    int distance = 0;
+    for (int w = 0; w < n_words; ++w) {
+      distance += __builtin_popcountll(words[w] ^ mask[w]);
+    }
+    out[m] = distance;
+  }
+}
+
+static void ScalarMaskDistances(const uint64_t *masks, int n_masks,
+                                int n_words, const uint64_t *mask, int *out) {
+  MaskDistancesImpl(masks, n_masks, n_words, mask, out);
+}
+
+#ifdef MAF_KERNELS_X86
+
+// Same code, compiled with the POPCNT instruction.
+__attribute__((target("popcnt"))) static void
+PopcntMaskDistances(const uint64_t *masks, int n_masks, int n_words,
+                    const uint64_t *mask, int *out) {
+  MaskDistancesImpl(masks, n_masks, n_words, mask, out);
+}
+
+#endif // MAF_KERNELS_X86
+
+void MaskDistances(const uint64_t *masks, int n_masks, int n_words,
+                   const uint64_t *mask, int *out) {
+  static auto distances_fn = [] {
+#ifdef MAF_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt"))
+      return PopcntMaskDistances;
+#endif
+    return ScalarMaskDistances;
+  }();
+  distances_fn(masks, n_masks, n_words, mask, out);
+}
+
+static void ScalarPremultiplyRowPlanar(PixelFormat format, const uint8_t *src,
+                                       int n, uint16_t *r, uint16_t *g,
+                                       uint16_t *b, uint16_t *a) {
+  int bytes_per_pixel = BytesPerPixel(format);
+  for (int i = 0; i < n; ++i) {
+    PremultipliedPixel pixel =
+        PremultiplyPixel(format, src + i * bytes_per_pixel);
+    r[i] = pixel.r;
+    g[i] = pixel.g;
+    b[i] = pixel.b;
+    a[i] = pixel.a;
+  }
+}
+
+#ifdef MAF_KERNELS_X86
+
+// Premultiplies the 4 pixels in `in`: shuffles them into RGBA order (adding
+// `alpha_fill`), widens to 16 bits and multiplies by the alpha (or by 255 for
+// the alpha itself and for already premultiplied pixels). Pixels 0-1 end up
+// interleaved in `lo` and pixels 2-3 in `hi`.
+__attribute__((target("sse4.2"))) static inline void
+Sse42Premultiply4(__m128i in, __m128i to_rgba, __m128i alpha_fill,
+                  bool premultiplied, __m128i &lo, __m128i &hi) {
+  constexpr char X = -128; // shuffle index that produces a zero byte
+  __m128i opaque = _mm_setr_epi8(0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0,
+                                 0, -1);
+  __m128i alpha_broadcast =
+      _mm_setr_epi8(3, 3, 3, X, 7, 7, 7, X, 11, 11, 11, X, 15, 15, 15, X);
+  __m128i rgba = _mm_or_si128(_mm_shuffle_epi8(in, to_rgba), alpha_fill);
+  __m128i factors =
+      premultiplied
+          ? _mm_set1_epi8(-1)
+          : _mm_or_si128(_mm_shuffle_epi8(rgba, alpha_broadcast), opaque);
+  lo = _mm_mullo_epi16(_mm_cvtepu8_epi16(rgba), _mm_cvtepu8_epi16(factors));
+  hi = _mm_mullo_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(rgba, 8)),
+                       _mm_cvtepu8_epi16(_mm_srli_si128(factors, 8)));
+}
+
+// Converts 8 pixels per step with `Sse42Premultiply4` and transposes the
+// interleaved results into the four planes.
+__attribute__((target("sse4.2"))) static void
+Sse42PremultiplyRowPlanar(PixelFormat format, const uint8_t *src, int n,
+                          uint16_t *r, uint16_t *g, uint16_t *b, uint16_t *a) {
+  constexpr char X = -128; // shuffle index that produces a zero byte
+  __m128i to_rgba, alpha_fill = _mm_setzero_si128();
+  __m128i opaque = _mm_setr_epi8(0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0,
+                                 0, -1);
+  switch (format) {
+  case PixelFormat::kBGRA:
+    to_rgba = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12,
+                            15);
+    break;
+  case PixelFormat::kRGB:
+    to_rgba = _mm_setr_epi8(0, 1, 2, X, 3, 4, 5, X, 6, 7, 8, X, 9, 10, 11, X);
+    alpha_fill = opaque;
+    break;
+  case PixelFormat::kGray:
+    to_rgba = _mm_setr_epi8(0, 0, 0, X, 1, 1, 1, X, 2, 2, 2, X, 3, 3, 3, X);
+    alpha_fill = opaque;
+    break;
+  default:
+    to_rgba = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+                            15);
+    break;
+  }
+  bool premultiplied = format == PixelFormat::kPremultipliedRGBA;
+
+  int bytes_per_pixel = BytesPerPixel(format);
+  int i = 0;
+  // Every 4 pixels are loaded as 16 bytes, which may be more than 4 pixels.
+  for (; i + 8 <= n && (i + 4) * bytes_per_pixel + 16 <= n * bytes_per_pixel;
+       i += 8) {
+    __m128i p01, p23, p45, p67;
+    Sse42Premultiply4(
+        _mm_loadu_si128((const __m128i *)(src + i * bytes_per_pixel)),
+        to_rgba, alpha_fill, premultiplied, p01, p23);
+    Sse42Premultiply4(
+        _mm_loadu_si128((const __m128i *)(src + (i + 4) * bytes_per_pixel)),
+        to_rgba, alpha_fill, premultiplied, p45, p67);
+    // r0 r2 g0 g2 b0 b2 a0 a2, r1 r3 g1 g3 b1 b3 a1 a3, ...
+    __m128i t0 = _mm_unpacklo_epi16(p01, p23);
+    __m128i t1 = _mm_unpackhi_epi16(p01, p23);
+    __m128i t2 = _mm_unpacklo_epi16(p45, p67);
+    __m128i t3 = _mm_unpackhi_epi16(p45, p67);
+    // r0 r1 r2 r3 g0 g1 g2 g3, b0 b1 b2 b3 a0 a1 a2 a3, ...
+    __m128i rg03 = _mm_unpacklo_epi16(t0, t1);
+    __m128i ba03 = _mm_unpackhi_epi16(t0, t1);
+    __m128i rg47 = _mm_unpacklo_epi16(t2, t3);
+    __m128i ba47 = _mm_unpackhi_epi16(t2, t3);
+    _mm_storeu_si128((__m128i *)(r + i), _mm_unpacklo_epi64(rg03, rg47));
+    _mm_storeu_si128((__m128i *)(g + i), _mm_unpackhi_epi64(rg03, rg47));
+    _mm_storeu_si128((__m128i *)(b + i), _mm_unpacklo_epi64(ba03, ba47));
+    _mm_storeu_si128((__m128i *)(a + i), _mm_unpackhi_epi64(ba03, ba47));
+  }
+  ScalarPremultiplyRowPlanar(format, src + i * bytes_per_pixel, n - i, r + i,
+                             g + i, b + i, a + i);
+}
+
+#endif // MAF_KERNELS_X86
+
+void PremultiplyRowPlanar(PixelFormat format, const uint8_t *src, int n,
+                          uint16_t *r, uint16_t *g, uint16_t *b, uint16_t *a) {
+  static auto row_fn = [] {
+#ifdef MAF_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+      return Sse42PremultiplyRowPlanar;
+#endif
+    return ScalarPremultiplyRowPlanar;
+  }();
+  row_fn(format, src, n, r, g, b, a);
+}
+
+static std::atomic<const MatchingKernel *> forced_kernel = nullptr;
+
+const MatchingKernel &BestMatchingKernel() {
+  if (const MatchingKernel *forced = forced_kernel.load()) {
+    return *forced;
+  }
+  static const MatchingKernel *best = [] {
+    const MatchingKernel *kernels[4];
+    int count = SupportedMatchingKernels(kernels, 4);
+    return kernels[count - 1];
+  }();
+  return *best;
+}
+
+void ForceMatchingKernel(const MatchingKernel *kernel) {
+  forced_kernel = kernel;
+}
+
+} // namespace maf
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+
+#include "maf/ansi_art.hh"
+
+namespace maf {
+
+// Glyph matching kernels.
+//
+// Every kernel accumulates its sums in `kKernelLanes` independent lanes (lane
+// `j` sums elements `i ≡ j (mod kKernelLanes)`) and then reduces the lanes with
+// the same fixed tree. Together with the absence of FMA contraction this makes
+// all of the kernels round identically, so the choice of glyphs doesn't depend
+// on the CPU that performs the rendering.
+constexpr int kKernelLanes = 16;
+
+// Rounds `n` up to a multiple of `kKernelLanes`.
+constexpr int KernelStride(int n) {
+  return (n + kKernelLanes - 1) / kKernelLanes * kKernelLanes;
+}
+
+struct MatchingKernel {
+  const char *name;
+  // Computes Σ coverage[i]·planes[c·stride + i] for each of the four planes
+  // `c` and stores the sums in `out`. `stride` must be a multiple of
+  // `kKernelLanes` and both buffers must be zero-padded up to it.
+  void (*weighted_sum)(const float *coverage, const float *planes, int stride,
+                       float out[4]);
+  // Block version of `weighted_sum` - the product of a glyph matrix
+  // (`n_glyphs` rows of `stride` coverage values) and a cell matrix (`n_cells`
+  // rows of four planes, `4·stride` values each). The sums of glyph `g` &
+  // cell `c` are stored at `out[(c·n_glyphs + g)·4]`. Gives the same results
+  // as calling `weighted_sum` for every pair.
+  void (*block_weighted_sums)(const float *glyphs, int n_glyphs,
+                              const float *cells, int n_cells, int stride,
+                              float *out);
+  // Incremental version of `weighted_sum`, for searches that stop early.
+  // Adds the products of elements `begin` ... `end - 1` (multiples of
+  // `kKernelLanes`) to the per-lane sums in `lanes` (4·kKernelLanes values,
+  // zeroed before the first call) and stores the current totals in `out`.
+  // Once all of the `stride` elements were added, `out` holds the same sums
+  // as `weighted_sum`.
+  void (*accumulate_weighted_sums)(const float *coverage, const float *planes,
+                                   int stride, int begin, int end,
+                                   float *lanes, float out[4]);
+};
+
+// Portable implementation. Always available.
+extern const MatchingKernel kScalarKernel;
+
+// Returns the fastest kernel supported by the current CPU, unless another one
+// was forced with `ForceMatchingKernel`.
+const MatchingKernel &BestMatchingKernel();
+
+// Makes `BestMatchingKernel` return `kernel` (nullptr restores the default).
+// Only affects AnsiArt instances created afterwards. Meant for checking that
+// all of the kernels agree.
+void ForceMatchingKernel(const MatchingKernel *kernel);
+
+// Returns all of the kernels supported by the current CPU, scalar first.
+// Useful for comparing their results.
+int SupportedMatchingKernels(const MatchingKernel **out, int max_count);
+
+// Binary matching.
+
+// Stores in `out` the Hamming distances between `mask` and each of the
+// `n_masks` masks in `masks`. All of them are `n_words` 64-bit words long.
+// Uses the POPCNT instruction when the CPU supports it.
+void MaskDistances(const uint64_t *masks, int n_masks, int n_words,
+                   const uint64_t *mask, int *out);
+
+// Pixel conversion.
+//
+// Images are sampled in premultiplied form, in units of 1/65025: r·a, g·a,
+// b·a & a·255 of an 8-bit pixel, so premultiplication is exact.
+struct PremultipliedPixel {
+  uint16_t r, g, b, a;
+};
+
+constexpr int BytesPerPixel(PixelFormat format) {
+  switch (format) {
+  case PixelFormat::kRGB:
+    return 3;
+  case PixelFormat::kGray:
+    return 1;
+  default:
+    return 4;
+  }
+}
+
+inline PremultipliedPixel PremultiplyPixel(PixelFormat format,
+                                           const uint8_t *p) {
+  switch (format) {
+  case PixelFormat::kRGBA:
+    return {uint16_t(p[0] * p[3]), uint16_t(p[1] * p[3]),
+            uint16_t(p[2] * p[3]), uint16_t(p[3] * 255)};
+  case PixelFormat::kBGRA:
+    return {uint16_t(p[2] * p[3]), uint16_t(p[1] * p[3]),
+            uint16_t(p[0] * p[3]), uint16_t(p[3] * 255)};
+  case PixelFormat::kRGB:
+    return {uint16_t(p[0] * 255), uint16_t(p[1] * 255), uint16_t(p[2] * 255),
+            255 * 255};
+  case PixelFormat::kGray:
+    return {uint16_t(p[0] * 255), uint16_t(p[0] * 255), uint16_t(p[0] * 255),
+            255 * 255};
+  case PixelFormat::kPremultipliedRGBA:
+    return {uint16_t(p[0] * 255), uint16_t(p[1] * 255), uint16_t(p[2] * 255),
+            uint16_t(p[3] * 255)};
+  }
+  return {};
+}
+
+// Converts a row of `n` pixels with `PremultiplyPixel` and stores the r, g, b
+// & a values in separate planes. Uses SIMD when the CPU supports it.
+void PremultiplyRowPlanar(PixelFormat format, const uint8_t *src, int n,
+                          uint16_t *r, uint16_t *g, uint16_t *b, uint16_t *a);
+
+} // namespace maf
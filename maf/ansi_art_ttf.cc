@@ -0,0 +1,491 @@
+// FreeType part of FontAtlas - rasterization, lazy loading & the atlas cache.
+//
+// Define MAF_ANSI_ART_NO_FREETYPE to build the library without FreeType.
+// FontAtlas::LoadTTF then always fails and atlases must be loaded with
+// FontAtlas::LoadAtlas (see `atlas_gen.cc`).
+
+#include "maf/ansi_art_atlas.hh"
+
+#ifndef MAF_ANSI_ART_NO_FREETYPE
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <iterator>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "maf/ansi_art_kernels.hh"
+#include "maf/thread_pool.hh"
+#include "maf/unicode.hh"
+
+namespace maf {
+
+// Loads the font & sets its size. Every rasterizing thread has its own face -
+// FreeType faces can't be shared between threads.
+static std::string OpenFace(FT_Library library, const uint8_t *data,
+                            size_t size, int font_size_pt, FT_Face &face) {
+  FT_Error ft_error =
+      FT_New_Memory_Face(library, (FT_Byte *)data, (FT_Long)size, 0, &face);
+  if (ft_error) {
+    return "Couldn't load font";
+  }
+  ft_error = FT_Set_Char_Size(face, /* handle to face object           */
+                              0,    /* char_width in 1/64th of points  */
+                              font_size_pt *
+                                  64, /* char_height in 1/64th of points */
+                              72,     /* horizontal device resolution    */
+                              72);    /* vertical device resolution      */
+  if (ft_error) {
+    return "FT_Set_Char_Size " + std::to_string(ft_error);
+  }
+  return "";
+}
+
+// Open font, ready for rasterizing. Lazily loaded atlases keep it, so that
+// `AddCharacters` doesn't have to load the font again.
+struct FontSource {
+  std::string ttf; // copy of the font file - FreeType reads it in place
+  int font_size_pt;
+  FT_Library library = nullptr;
+  FT_Face face = nullptr;
+  int glyph_width;
+  int glyph_height;
+  int baseline;
+  // Taken while rasterizing with `face`.
+  pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+
+  ~FontSource() {
+    if (library) {
+      FT_Done_FreeType(library); // also releases the face
+    }
+  }
+};
+
+static std::string OpenSource(const uint8_t *data, size_t size,
+                              int font_size_pt,
+                              std::shared_ptr<FontSource> &source) {
+  source = std::make_shared<FontSource>();
+  source->ttf.assign((const char *)data, size);
+  source->font_size_pt = font_size_pt;
+  FT_Error ft_error = FT_Init_FreeType(&source->library);
+  if (ft_error) {
+    source->library = nullptr;
+    return "Couldn't initialize freetype: " + std::to_string(ft_error);
+  }
+  std::string error =
+      OpenFace(source->library, (const uint8_t *)source->ttf.data(), size,
+               font_size_pt, source->face);
+  if (!error.empty()) {
+    return error;
+  }
+  FT_Face face = source->face;
+  source->glyph_width = face->size->metrics.max_advance / 64;
+  source->glyph_height = face->size->metrics.height / 64;
+
+  // The unicode '█' starts at the top of the character cell.
+  // We use its `bitmap_top` offset to find the baseline position.
+  uint32_t block_index = FT_Get_Char_Index(face, 0x2588);
+  FT_Load_Glyph(face, block_index, FT_LOAD_RENDER);
+  source->baseline = face->glyph->bitmap_top;
+  return "";
+}
+
+struct Candidate {
+  FT_ULong charcode;
+  FT_UInt gindex;
+};
+
+static bool IsCandidate(FT_Face face, FT_ULong charcode, FT_UInt gindex) {
+  if (gindex == 0 || charcode == 9 || charcode == 13) {
+    return false;
+  }
+  char buf[80];
+  FT_Get_Glyph_Name(face, gindex, buf, sizeof(buf));
+  return strchr(buf, '.') == nullptr;
+}
+
+// All glyphs of the font, in charcode order.
+static std::vector<Candidate> AllCandidates(FT_Face face) {
+  std::vector<Candidate> candidates;
+  FT_UInt gindex;
+  FT_ULong charcode = FT_Get_First_Char(face, &gindex);
+  while (gindex != 0) {
+    if (IsCandidate(face, charcode, gindex)) {
+      candidates.push_back({charcode, gindex});
+    }
+    charcode = FT_Get_Next_Char(face, charcode, &gindex);
+  }
+  return candidates;
+}
+
+// Glyphs of the given (sorted) characters that the font has.
+static std::vector<Candidate> CandidatesFor(FT_Face face,
+                                            const std::u32string &characters) {
+  std::vector<Candidate> candidates;
+  for (char32_t charcode : characters) {
+    FT_UInt gindex = FT_Get_Char_Index(face, charcode);
+    if (IsCandidate(face, charcode, gindex)) {
+      candidates.push_back({charcode, gindex});
+    }
+  }
+  return candidates;
+}
+
+// Number of glyphs that a rasterizing thread claims at once.
+static constexpr int kRasterChunk = 64;
+
+// Rasterizes the monospace glyphs among `candidates`, appending them (in the
+// order of `candidates`) to `glyphs` & `bitmaps`. The caller must hold
+// `source.mut`.
+static std::string RasterizeGlyphs(FontSource &source,
+                                   const std::vector<Candidate> &candidates,
+                                   std::vector<Glyph> &glyphs,
+                                   std::vector<uint8_t> &bitmaps) {
+  int glyph_width = source.glyph_width;
+  int glyph_height = source.glyph_height;
+  int baseline = source.baseline;
+  int stride = KernelStride(glyph_width * glyph_height);
+  int n = glyph_width * glyph_height;
+
+  // Every candidate gets a pre-reserved slot, so the threads never touch the
+  // same memory and the atlas doesn't depend on the order in which they run.
+  int n_candidates = candidates.size();
+  if (n_candidates == 0) {
+    return "";
+  }
+  size_t first_glyph = glyphs.size();
+  glyphs.resize(first_glyph + n_candidates);
+  bitmaps.resize((first_glyph + n_candidates) * stride, 0);
+  Glyph *slots = glyphs.data() + first_glyph;
+  uint8_t *slot_bitmaps = bitmaps.data() + first_glyph * stride;
+  // 1 for monospace glyphs, 0 for the ones to skip.
+  std::vector<uint8_t> accepted(n_candidates, 0);
+  std::vector<std::string> errors(n_candidates);
+
+  auto rasterize = [&](FT_Face face, int c) {
+    FT_Error ft_error =
+        FT_Load_Glyph(face, candidates[c].gindex, FT_LOAD_RENDER);
+    if (ft_error) {
+      errors[c] = "FT_Load_Glyph " + std::to_string(ft_error);
+      return;
+    }
+    FT_GlyphSlot glyph = face->glyph;
+    if (glyph->advance.x / 64 != glyph_width) {
+      return;
+    }
+    auto bitmap = glyph->bitmap;
+    if (bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
+      errors[c] = "FT_Bitmap is not FT_PIXEL_MODE_GRAY";
+      return;
+    }
+    Glyph &new_glyph = slots[c];
+    new_glyph.unicode = candidates[c].charcode;
+    std::string utf8 = UnicodeToUTF8(candidates[c].charcode);
+    memset(new_glyph.utf8, 0, sizeof(new_glyph.utf8));
+    memcpy(new_glyph.utf8, utf8.data(),
+           std::min(utf8.size(), sizeof(new_glyph.utf8) - 1));
+
+    uint8_t *pixels = &slot_bitmaps[(size_t)c * stride];
+    for (int y = 0; y < bitmap.rows; ++y) {
+      for (int x = 0; x < bitmap.width; ++x) {
+        int tile_x = glyph->bitmap_left + x;
+        if (tile_x >= glyph_width)
+          continue;
+        if (tile_x < 0)
+          continue;
+        int tile_y = baseline - glyph->bitmap_top + y;
+        if (tile_y >= glyph_height)
+          continue;
+        if (tile_y < 0)
+          continue;
+        int i = tile_y * glyph_width + tile_x;
+        pixels[i] = bitmap.buffer[y * bitmap.pitch + x];
+      }
+    }
+    new_glyph.coverage_sum = 0;
+    new_glyph.coverage_sq_sum = 0;
+    for (int i = 0; i < n; ++i) {
+      float w = pixels[i] / 255.f;
+      new_glyph.coverage_sum += w;
+      new_glyph.coverage_sq_sum += w * w;
+    }
+    accepted[c] = 1;
+  };
+
+  int n_chunks = (n_candidates + kRasterChunk - 1) / kRasterChunk;
+  int n_threads = std::clamp((int)sysconf(_SC_NPROCESSORS_ONLN), 1, n_chunks);
+  if (n_threads <= 1) {
+    for (int c = 0; c < n_candidates; ++c) {
+      rasterize(source.face, c);
+    }
+  } else {
+    // The calling thread uses the face of `source`, the other threads open
+    // their own faces on the same font data.
+    std::atomic<int> next_chunk = 0;
+    std::vector<std::string> thread_errors(n_threads);
+    ThreadPool pool;
+    pool.Reserve(n_threads - 1);
+    pool.Run(n_threads, [&](int t) {
+      FT_Library thread_library = nullptr;
+      FT_Face thread_face = source.face;
+      if (t > 0) {
+        FT_Error ft_error = FT_Init_FreeType(&thread_library);
+        if (ft_error) {
+          thread_errors[t] =
+              "Couldn't initialize freetype: " + std::to_string(ft_error);
+          return;
+        }
+        thread_errors[t] = OpenFace(
+            thread_library, (const uint8_t *)source.ttf.data(),
+            source.ttf.size(), source.font_size_pt, thread_face);
+      }
+      while (thread_errors[t].empty()) {
+        int chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= n_chunks) {
+          break;
+        }
+        int end = std::min(n_candidates, (chunk + 1) * kRasterChunk);
+        for (int c = chunk * kRasterChunk; c < end; ++c) {
+          rasterize(thread_face, c);
+        }
+      }
+      if (thread_library) {
+        FT_Done_FreeType(thread_library); // also releases the face
+      }
+    });
+    for (auto &thread_error : thread_errors) {
+      if (!thread_error.empty()) {
+        return thread_error;
+      }
+    }
+  }
+
+  // Compact the accepted glyphs, keeping the candidate order.
+  size_t n_glyphs = first_glyph;
+  for (int c = 0; c < n_candidates; ++c) {
+    if (!errors[c].empty()) {
+      return errors[c];
+    }
+    if (accepted[c]) {
+      glyphs[n_glyphs] = slots[c];
+      std::copy_n(slot_bitmaps + (size_t)c * stride, stride,
+                  bitmaps.data() + n_glyphs * stride);
+      ++n_glyphs;
+    }
+  }
+  glyphs.resize(n_glyphs);
+  bitmaps.resize(n_glyphs * stride);
+  return "";
+}
+
+std::shared_ptr<const FontAtlas>
+FontAtlasImpl::AddCharacters(const std::string &characters,
+                             std::string &error) const {
+  error = "";
+  if (source == nullptr) {
+    return shared_from_this();
+  }
+  pthread_mutex_lock(&source->mut);
+  std::u32string added;
+  for (char32_t c : SortedCharacters(characters)) {
+    if (!std::binary_search(requested.begin(), requested.end(), c)) {
+      added.push_back(c);
+    }
+  }
+  if (added.empty()) {
+    pthread_mutex_unlock(&source->mut);
+    return shared_from_this();
+  }
+
+  std::u32string all_requested;
+  std::merge(requested.begin(), requested.end(), added.begin(), added.end(),
+             std::back_inserter(all_requested));
+  std::vector<Glyph> new_glyphs;
+  std::vector<uint8_t> new_bitmaps;
+  error = RasterizeGlyphs(*source, CandidatesFor(source->face, added),
+                          new_glyphs, new_bitmaps);
+  if (error.empty() && new_glyphs.empty()) {
+    // Remember the characters anyway, so that later calls (e.g. every
+    // render) don't look for them again.
+    requested = std::move(all_requested);
+    error = "The font has none of the added characters";
+  }
+  pthread_mutex_unlock(&source->mut);
+  if (!error.empty()) {
+    return nullptr;
+  }
+
+  // Merge the new glyphs into the existing ones, keeping the charcode order.
+  std::vector<Glyph> merged_glyphs;
+  std::vector<uint8_t> merged_bitmaps;
+  merged_glyphs.reserve(glyphs.size() + new_glyphs.size());
+  merged_bitmaps.reserve(merged_glyphs.capacity() * stride);
+  size_t old_i = 0, new_i = 0;
+  while (old_i < glyphs.size() || new_i < new_glyphs.size()) {
+    if (new_i == new_glyphs.size() ||
+        (old_i < glyphs.size() &&
+         glyphs[old_i].unicode < new_glyphs[new_i].unicode)) {
+      merged_glyphs.push_back(glyphs[old_i]);
+      const uint8_t *pixels = Pixels(glyphs[old_i]);
+      merged_bitmaps.insert(merged_bitmaps.end(), pixels, pixels + stride);
+      ++old_i;
+    } else {
+      merged_glyphs.push_back(new_glyphs[new_i]);
+      auto pixels = new_bitmaps.begin() + new_i * stride;
+      merged_bitmaps.insert(merged_bitmaps.end(), pixels, pixels + stride);
+      ++new_i;
+    }
+  }
+  uint64_t key = AtlasKey((const uint8_t *)source->ttf.data(),
+                          source->ttf.size(), source->font_size_pt,
+                          all_requested);
+  auto atlas = Build(key, glyph_width, glyph_height, merged_glyphs,
+                     merged_bitmaps);
+  atlas->source = source;
+  atlas->requested = std::move(all_requested);
+  return atlas;
+}
+
+// Maps a cached atlas into memory. Returns nullptr if there is no usable
+// atlas at `path`.
+static std::shared_ptr<FontAtlasImpl> MapCachedAtlas(const std::string &path,
+                                                     uint64_t key) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(AtlasHeader)) {
+    mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return nullptr;
+  }
+  std::string error;
+  auto atlas = FontAtlasImpl::Wrap((const uint8_t *)mapping, st.st_size, error);
+  if (atlas == nullptr || ((const AtlasHeader *)mapping)->key != key) {
+    munmap(mapping, st.st_size);
+    return nullptr;
+  }
+  atlas->mapping = mapping;
+  atlas->mapping_size = st.st_size;
+  return atlas;
+}
+
+// Writes the atlas blob to `path`. The file is written under a temporary name
+// & renamed, so concurrent readers never see a partial atlas. Failures are
+// ignored - the cache is only an optimization.
+static void WriteCachedAtlas(const std::string &path,
+                             const FontAtlasImpl &atlas) {
+  // Every writer gets its own temporary file - threads of one process may be
+  // caching the same font at the same time.
+  std::string tmp_path = path + ".tmpXXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    return;
+  }
+  fchmod(fd, 0644);
+  size_t written = 0;
+  while (written < atlas.blob_size) {
+    ssize_t n = write(fd, atlas.blob + written, atlas.blob_size - written);
+    if (n <= 0) {
+      break;
+    }
+    written += n;
+  }
+  close(fd);
+  if (written != atlas.blob_size ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
+std::shared_ptr<const FontAtlas>
+FontAtlas::LoadTTF(const uint8_t *data, size_t size, std::string &error,
+                   const std::string &cache_dir, int font_size_pt,
+                   const std::string &characters) {
+  if (font_size_pt <= 0) {
+    error = "Invalid font size: " + std::to_string(font_size_pt);
+    return nullptr;
+  }
+  std::u32string requested = SortedCharacters(characters);
+  bool lazy = !requested.empty();
+  uint64_t key = AtlasKey(data, size, font_size_pt, requested);
+  std::string cache_path;
+  std::shared_ptr<FontAtlasImpl> atlas;
+  if (!cache_dir.empty()) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.atlas", (unsigned long long)key);
+    cache_path = cache_dir + "/" + name;
+    atlas = MapCachedAtlas(cache_path, key);
+  }
+  std::shared_ptr<FontSource> source;
+  if (atlas == nullptr || lazy) {
+    error = OpenSource(data, size, font_size_pt, source);
+    if (!error.empty()) {
+      return nullptr;
+    }
+  }
+  if (atlas == nullptr) {
+    std::vector<Glyph> glyphs;
+    std::vector<uint8_t> bitmaps;
+    error = RasterizeGlyphs(*source,
+                            lazy ? CandidatesFor(source->face, requested)
+                                 : AllCandidates(source->face),
+                            glyphs, bitmaps);
+    if (!error.empty()) {
+      return nullptr;
+    }
+    if (glyphs.empty()) {
+      error = lazy ? "The font has none of the requested characters"
+                   : "The font has no monospace glyphs";
+      return nullptr;
+    }
+    atlas = FontAtlasImpl::Build(key, source->glyph_width,
+                                 source->glyph_height, glyphs, bitmaps);
+    if (!cache_path.empty()) {
+      WriteCachedAtlas(cache_path, *atlas);
+    }
+  }
+  if (lazy) {
+    // Keep the font open for `AddCharacters`.
+    atlas->source = source;
+    atlas->requested = std::move(requested);
+  }
+  error = "";
+  return atlas;
+}
+
+} // namespace maf
+
+#else // MAF_ANSI_ART_NO_FREETYPE
+
+namespace maf {
+
+std::shared_ptr<const FontAtlas>
+FontAtlas::LoadTTF(const uint8_t *data, size_t size, std::string &error,
+                   const std::string &cache_dir, int font_size_pt,
+                   const std::string &characters) {
+  error = "Built without FreeType - use FontAtlas::LoadAtlas";
+  return nullptr;
+}
+
+std::shared_ptr<const FontAtlas>
+FontAtlasImpl::AddCharacters(const std::string &characters,
+                             std::string &error) const {
+  // Atlases are never lazy without FreeType.
+  error = "";
+  return shared_from_this();
+}
+
+} // namespace maf
+
+#endif // MAF_ANSI_ART_NO_FREETYPE
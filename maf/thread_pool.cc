@@ -0,0 +1,90 @@
+#include "maf/thread_pool.hh"
+
+#include <atomic>
+#include <memory>
+
+namespace maf {
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mut);
+  stopping = true;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&mut);
+  for (auto &thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+}
+
+void ThreadPool::Reserve(int n_threads) {
+  pthread_mutex_lock(&mut);
+  while ((int)threads.size() < n_threads) {
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, ThreadMain, this)) {
+      break;
+    }
+    threads.push_back(thread);
+  }
+  pthread_mutex_unlock(&mut);
+}
+
+void ThreadPool::Post(std::function<void()> fn) {
+  pthread_mutex_lock(&mut);
+  queue.push_back(std::move(fn));
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&mut);
+}
+
+void *ThreadPool::ThreadMain(void *arg) {
+  auto self = (ThreadPool *)arg;
+  pthread_mutex_lock(&self->mut);
+  while (true) {
+    if (!self->queue.empty()) {
+      auto fn = std::move(self->queue.front());
+      self->queue.pop_front();
+      pthread_mutex_unlock(&self->mut);
+      fn();
+      pthread_mutex_lock(&self->mut);
+    } else if (self->stopping) {
+      break;
+    } else {
+      pthread_cond_wait(&self->wake, &self->mut);
+    }
+  }
+  pthread_mutex_unlock(&self->mut);
+  return nullptr;
+}
+
+void ThreadPool::Run(int n, const std::function<void(int)> &fn) {
+  // Indices are claimed dynamically so the calling thread can do all of the
+  // work by itself when the pool is busy. Helpers that start after everything
+  // was claimed return immediately.
+  struct Batch {
+    std::atomic<int> next = 0;
+    int done = 0;
+    pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t all_done = PTHREAD_COND_INITIALIZER;
+  };
+  auto batch = std::make_shared<Batch>();
+  auto work = [batch, n, &fn] {
+    int i;
+    while ((i = batch->next.fetch_add(1)) < n) {
+      fn(i);
+      pthread_mutex_lock(&batch->mut);
+      if (++batch->done == n) {
+        pthread_cond_broadcast(&batch->all_done);
+      }
+      pthread_mutex_unlock(&batch->mut);
+    }
+  };
+  for (int i = 1; i < n; ++i) {
+    Post(work);
+  }
+  work();
+  pthread_mutex_lock(&batch->mut);
+  while (batch->done < n) {
+    pthread_cond_wait(&batch->all_done, &batch->mut);
+  }
+  pthread_mutex_unlock(&batch->mut);
+}
+
+} // namespace maf
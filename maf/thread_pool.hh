@@ -0,0 +1,41 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <pthread.h>
+#include <vector>
+
+namespace maf {
+
+// Set of long-lived worker threads. Threads are started lazily and park on a
+// condition variable while there is no work. The destructor finishes all of
+// the queued work and joins the threads.
+class ThreadPool {
+public:
+  ThreadPool() = default;
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  ~ThreadPool();
+
+  // Starts more threads, if there are less than `n_threads` of them.
+  void Reserve(int n_threads);
+
+  // Queues `fn` for execution on one of the pool threads.
+  void Post(std::function<void()> fn);
+
+  // Calls `fn(0)` ... `fn(n - 1)` in parallel and returns once all of the
+  // calls are done. The calling thread takes part in the work, so this is safe
+  // to call from the pool threads themselves.
+  void Run(int n, const std::function<void(int)> &fn);
+
+private:
+  static void *ThreadMain(void *arg);
+
+  pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+  bool stopping = false;
+  std::deque<std::function<void()>> queue;
+  std::vector<pthread_t> threads;
+};
+
+} // namespace maf
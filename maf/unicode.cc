@@ -22,4 +22,43 @@ std::string UnicodeToUTF8(unsigned int codepoint) {
   return s;
 }
 
+std::u32string UTF8ToUnicode(const std::string &utf8) {
+  std::u32string codepoints;
+  size_t i = 0;
+  while (i < utf8.size()) {
+    unsigned char lead = utf8[i];
+    int length;
+    char32_t codepoint;
+    if (lead < 0x80) {
+      length = 1;
+      codepoint = lead;
+    } else if ((lead & 0xe0) == 0xc0) {
+      length = 2;
+      codepoint = lead & 0x1f;
+    } else if ((lead & 0xf0) == 0xe0) {
+      length = 3;
+      codepoint = lead & 0x0f;
+    } else if ((lead & 0xf8) == 0xf0) {
+      length = 4;
+      codepoint = lead & 0x07;
+    } else {
+      ++i;
+      continue;
+    }
+    int j = 1;
+    for (; j < length && i + j < utf8.size(); ++j) {
+      unsigned char continuation = utf8[i + j];
+      if ((continuation & 0xc0) != 0x80) {
+        break;
+      }
+      codepoint = (codepoint << 6) | (continuation & 0x3f);
+    }
+    if (j == length) {
+      codepoints.push_back(codepoint);
+    }
+    i += j;
+  }
+  return codepoints;
+}
+
 } // namespace maf
\ No newline at end of file
@@ -6,4 +6,7 @@ namespace maf {
 
 std::string UnicodeToUTF8(unsigned int codepoint);
 
+// Decodes a UTF-8 string into code points. Malformed bytes are skipped.
+std::u32string UTF8ToUnicode(const std::string &utf8);
+
 } // namespace maf